@@ -1,8 +1,26 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <ncurses.h>
 #include <pthread.h>
 #include <readline/readline.h>
@@ -11,8 +29,116 @@
 #define len_command 30
 #define max_args 10
 #define max_commands 10
-#define MAX_VECTOR_DIMENSION 100
 #define MAX_THREADS 3
+#define MAX_PATTERN 256
+#define MAX_SEARCH_THREADS 16
+#define SEARCH_LINES_PER_THREAD 50000
+#define UNDO_BUDGET (4 * 1024 * 1024) // memory budget of the editor undo journal in bytes
+#define HISTORY_FILE ".shell_history"
+#define HISTORY_MAX_BYTES (64 * 1024 * 1024)  // the history file is compacted beyond this
+#define HISTORY_KEEP_BYTES (32 * 1024 * 1024) // newest unique commands kept by a compaction
+#define HISTORY_LOAD 1000   // entries loaded into readline for the arrow keys
+#define HISTORY_SHOW 20     // entries printed by 'history'
+#define HISTORY_RESULTS 50  // matches printed by 'history search'
+#define PARALLEL_MAX_SLOTS 256
+#define GLOB_CACHE_DIRS 64          // directory listings kept for glob expansion
+#define DENTS_BUFFER (256 * 1024)   // bytes read per getdents64 call
+#define MAX_RLIMITS 8
+#define IOPRIO_CLASS_SHIFT 13       // no glibc header for ioprio_set
+#define IOPRIO_WHO_PROCESS 1
+#define TIMEOUT_GRACE_MS 5000  // time between TERM and KILL unless 'timeout -k' says otherwise
+#define TIMEOUT_STATUS 124
+#define LS_LONG_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME | STATX_BLOCKS)
+
+// Structure to store a growable byte buffer, always NUL terminated
+typedef struct {
+    char* data;
+    size_t len;
+    size_t capacity;
+} growBuf;
+
+// Structure to store one job of the parallel builtin
+typedef struct {
+    char* arg;
+    pid_t pid;      // 0 once reaped
+    int pidfd;      // -1 without pidfd support
+    int outFd;      // memfd holding the job output when grouping, -1 otherwise
+    int status;
+} parallelJob;
+
+// Structure to store a shell variable
+typedef struct {
+    char* name;
+    char* value;
+} shellVar;
+
+// Shell variables set with NAME=value
+shellVar* shellVars = NULL;
+int numVars = 0;
+int varCapacity = 0;
+
+// Types of the elements of a compiled glob pattern
+enum { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_SET };
+
+// Structure to store one element of a compiled glob pattern
+typedef struct {
+    int type;
+    char c;
+    unsigned char set[32];  // bitmap of the characters accepted by a [...] set
+} globToken;
+
+// Structure to store a cached directory listing, valid while the directory mtime is unchanged
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    growBuf names;          // NUL separated entry names
+    int* offsets;
+    unsigned char* types;   // d_type of each entry
+    int numEntries;
+    unsigned long lastUse;  // 0 for a free slot
+} dirListing;
+
+// Directory listings shared by all glob expansions of the shell
+dirListing dirCache[GLOB_CACHE_DIRS];
+unsigned long dirCacheClock = 0;
+
+// Structure to store the scheduling controls of a 'with' prefix
+typedef struct {
+    int set_cpus;
+    cpu_set_t cpus;
+    int set_nice;
+    int nice;           // added to the current nice value
+    int set_ioprio;
+    int ioprio;
+    int num_limits;
+    int limit_resource[MAX_RLIMITS];
+    rlim_t limit_value[MAX_RLIMITS];
+} schedPolicy;
+
+// Structure to store a child process supervised through its pidfd
+typedef struct {
+    pid_t pid;
+    int pidfd;
+    long timeout_ms;    // 0 for no timeout
+    long grace_ms;      // time between TERM and KILL
+    long deadline;      // monotonic ms of the next signal, 0 for none
+    int signalled;      // 0, SIGTERM or SIGKILL, the last signal sent
+    int status;
+    char* name;         // command of the stage, for the reports
+} childProc;
+
+// Exit status of the last command, expanded by $?
+int lastStatus = 0;
+
+// Structure to store a vector read from a file, sparse vectors keep only their nonzeros
+typedef struct {
+    int sparse;
+    int dimension;      // number of values, for sparse vectors the largest index + 1
+    int nnz;            // number of stored values
+    int* idx;           // sorted indices of the values, NULL for dense vectors
+    double* val;
+} vecData;
 
 // Structure to pass arguments to the thread functions
 struct ThreadArgs {
@@ -22,8 +148,46 @@ struct ThreadArgs {
     int dimension;
     int start_idx;
     int end_idx;
+    const schedPolicy* policy; // NULL when no 'with' prefix was given
+    const vecData* sparse1;    // operands of the sparse kernels
+    const vecData* sparse2;
+    int start2;                // range of sparse2 merged with [start_idx, end_idx) of sparse1
+    int end2;
+    double sign;               // -1 to subtract the second operand
+    int* result_idx;           // output of a sparse-sparse merge, written from start_idx + start2
+    int result_nnz;
+    double partial;            // dot product of the range
 };
 
+// Structure to store the posting list of one trigram
+typedef struct {
+    unsigned int trigram;
+    int count;
+    int capacity;
+    int* ids;       // ids of the entries containing the trigram, ascending
+} histPosting;
+
+// Structure to store the memory-mapped history file and its trigram index
+typedef struct {
+    char* path;
+    char* map;
+    size_t mapSize;
+    size_t indexed;     // bytes of the file already split into entries
+    ino_t inode;
+    size_t* offsets;    // start of each entry in the file
+    int* lengths;
+    int numEntries;
+    int numIndexed;     // entries already in the trigram index, built on the first search
+    int entryCapacity;
+    histPosting* table; // open addressing hash table keyed by trigram
+    int tableSize;
+    int numTrigrams;
+    char* last;         // last command added by this shell
+} cmdHistory;
+
+// Command history, global so the readline key binding can reach it
+cmdHistory shellHistory;
+
 // Structure to store editor stats
 typedef struct {
     int lines;
@@ -31,27 +195,103 @@ typedef struct {
     int characters;
 } viStats;
 
-//tokenize pipe separated multiple commands
-int processPipe(char* command, char** parsedComm){
-    int i=0;
-    char *token = strtok(command, "|");
-    while (token != NULL) {
-        parsedComm[i++] = token;
-        token = strtok(NULL, "|");
+// Structure to store the editor search state
+typedef struct {
+    char pattern[MAX_PATTERN];
+    int patLen;
+    int ignoreCase;
+    int backward;
+    int shift[256]; // Boyer-Moore-Horspool bad character shifts
+} viSearch;
+
+// Types of edits recorded in the undo journal
+enum { EDIT_INSERT, EDIT_DELETE, EDIT_SPLIT, EDIT_MERGE, EDIT_LINE };
+
+// Structure to store one edit of the undo journal
+typedef struct {
+    int type;
+    int group;      // edits made by one command share a group, 0 for a single edit
+    int sealed;     // set once no more keystrokes may be coalesced into the edit
+    int y;
+    int x;
+    int beforeX, beforeY;   // cursor before the edit
+    int afterX, afterY;     // cursor after the edit
+    int len;        // bytes of text
+    int capacity;
+    char* text;     // inserted run, deleted run in deletion order, or old and new line for EDIT_LINE
+} viEdit;
+
+// Structure to store the undo and redo stacks of the editor
+typedef struct {
+    viEdit** undo;
+    int numUndo;
+    int undoCapacity;
+    viEdit** redo;
+    int numRedo;
+    int redoCapacity;
+    size_t bytes;       // memory held by the recorded edits
+    size_t budget;      // oldest edits are dropped beyond this
+    int nextGroup;
+    int droppedGroup;   // group evicted while it was being recorded
+} viJournal;
+
+// Structure to pass a range of lines to the search threads
+struct SearchArgs {
+    viSearch* search;
+    char** lines;
+    char** oldLines; // when set, replaced lines are kept here instead of being freed
+    const char* replacement;
+    int global;
+    int start_idx;
+    int end_idx;
+    int count;
+};
+
+// Function to find the ')' closing a $( substitution, or the end of the text
+const char* substitutionEnd(const char* p) {
+    for (int depth = 0; *p; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && depth-- == 0) {
+            break;
+        }
     }
-    parsedComm[i] = NULL;
-    return i;
+    return p;
 }
 
-//tokenize the commands into an array of arguments
-int processCommand(char* command, char** parsedArgs){
+// Function to find a syntax token such as '|' or '<<' outside the $( ) substitutions of a command
+char* findSyntax(const char* text, const char* token) {
+    size_t len = strlen(token);
+    for (const char* p = text; *p; p++) {
+        if (p[0] == '\\' && p[1] == '$') { // escaped dollar
+            p++;
+        } else if (p[0] == '$' && p[1] == '(') {
+            p = substitutionEnd(p + 2);
+            if (*p == '\0') {
+                break;
+            }
+        } else if (strncmp(p, token, len) == 0) {
+            return (char*)p;
+        }
+    }
+    return NULL;
+}
+
+//tokenize pipe separated multiple commands, a '|' inside a $( ) substitution is left to it
+int processPipe(char* command, char** parsedComm){
     int i=0;
-    char *token = strtok(command, " ");
-    while (token != NULL) {
-        parsedArgs[i++] = token;
-        token = strtok(NULL, " ");
+    char* token = command;
+    while (token != NULL && i < max_commands - 1) {
+        char* bar = findSyntax(token, "|");
+        if (bar) {
+            *bar = '\0';
+        }
+        if (*token) {
+            parsedComm[i++] = token;
+        }
+        token = bar ? bar + 1 : NULL;
     }
-    parsedArgs[i] = NULL;
+    parsedComm[i] = NULL;
     return i;
 }
 
@@ -63,17 +303,201 @@ void removeNewline(char* str) {
     }
 }
 
-//change directory function
-void changeDir(char *command){
-    char* parsedArgs[max_args];
-    int num_args = processCommand(command, parsedArgs);
+// Function to append bytes to a growable buffer
+void bufAppend(growBuf* buf, const char* data, size_t len) {
+    if (buf->len + len + 1 > buf->capacity) {
+        buf->capacity = (buf->len + len + 1 > 2 * buf->capacity) ? buf->len + len + 1 : 2 * buf->capacity;
+        buf->data = (char*)realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+// Function to read an fd until end of file into a growable buffer
+void bufReadFd(growBuf* buf, int fd) {
+    while (1) {
+        if (buf->capacity - buf->len < 4096) {
+            buf->capacity = 2 * buf->capacity + 4096;
+            buf->data = (char*)realloc(buf->data, buf->capacity);
+        }
+        ssize_t n = read(fd, buf->data + buf->len, buf->capacity - buf->len - 1);
+        if (n <= 0) {
+            break;
+        }
+        buf->len += n;
+    }
+    if (buf->data) {
+        buf->data[buf->len] = '\0';
+    }
+}
+
+// Functions of the expansion, defined with the shell variables
+int tokenizeCommand(const char* command, char*** words);
+char* expandWords(const char* text);
+
+// Function to free a NULL terminated list of words
+void freeWords(char** words) {
+    for (int i = 0; words[i]; i++) {
+        free(words[i]);
+    }
+    free(words);
+}
+
+// Function to join words with single spaces
+char* joinWords(char** words, int num_words) {
+    growBuf out = {NULL, 0, 0};
+    bufAppend(&out, "", 0);
+    for (int i = 0; i < num_words; i++) {
+        if (i > 0) {
+            bufAppend(&out, " ", 1);
+        }
+        bufAppend(&out, words[i], strlen(words[i]));
+    }
+    return out.data;
+}
+
+// Function to hand a buffer to a child as a readable fd, a pipe for small bodies and a memfd otherwise
+int bufferFd(const char* data, size_t len) {
+    if (len <= PIPE_BUF) { // fits in an empty pipe without blocking
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            perror("pipe");
+            return -1;
+        }
+        if (len > 0 && write(pipefd[1], data, len) < 0) {
+            perror("write");
+        }
+        close(pipefd[1]);
+        return pipefd[0];
+    }
+
+    int fd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Function to read the bodies of the '<<WORD' here-documents of a command, returns their number
+int readHereDocs(const char* command, growBuf* hereDocs) {
+    int num_docs = 0;
+    const char* p = command;
+    while (num_docs < max_commands && (p = findSyntax(p, "<<")) != NULL) {
+        if (p[2] == '<') { // here-string, nothing to read
+            p += 3;
+            continue;
+        }
+        p += 2;
+        while (*p == ' ') {
+            p++;
+        }
+        char delim[len_command + 1];
+        int d = 0;
+        for (; *p && *p != ' ' && *p != '|'; p++) {
+            if (*p != '\'' && *p != '"' && d < len_command) {
+                delim[d++] = *p;
+            }
+        }
+        delim[d] = '\0';
+
+        growBuf* body = &hereDocs[num_docs++];
+        memset(body, 0, sizeof(*body));
+        bufAppend(body, "", 0);
+        while (1) {
+            char* line = readline("> ");
+            if (line == NULL) {
+                break;
+            }
+            if (strcmp(line, delim) == 0) {
+                free(line);
+                break;
+            }
+            bufAppend(body, line, strlen(line));
+            bufAppend(body, "\n", 1);
+            free(line);
+        }
+    }
+    return num_docs;
+}
+
+// Function to strip the '<<WORD' and '<<< word' redirections from a stage, returns the fd to read
+// the last one from or -1; every here-document of the stage is consumed from hereDocs
+int hereInput(char* stage, growBuf* hereDocs, int* nextDoc) {
+    int fd = -1;
+    char* start;
+    while ((start = findSyntax(stage, "<<")) != NULL) {
+        if (fd >= 0) {
+            close(fd); // as in sh, the last redirection wins
+            fd = -1;
+        }
+        char* p = start + 2;
+        if (*p == '<') { // here-string: the next word, or a quoted string, plus a newline
+            p++;
+            while (*p == ' ') {
+                p++;
+            }
+            char quote = (*p == '\'' || *p == '"') ? *p++ : ' ';
+            char* end = p;
+            while (*end && *end != quote) { // a $( ) substitution may hold the quote or spaces
+                end = (end[0] == '$' && end[1] == '(') ? (char*)substitutionEnd(end + 2) : end;
+                end += (*end != '\0');
+            }
+            growBuf word = {NULL, 0, 0};
+            bufAppend(&word, p, end - p);
+            if (quote != '\'') { // expanded like any other word, single quotes keep it literal
+                char* expanded = expandWords(word.data);
+                word.len = 0;
+                bufAppend(&word, expanded, strlen(expanded));
+                free(expanded);
+            }
+            bufAppend(&word, "\n", 1);
+            fd = bufferFd(word.data, word.len);
+            free(word.data);
+            p = (*end && quote != ' ') ? end + 1 : end;
+        } else { // here-document read by readHereDocs
+            while (*p == ' ') {
+                p++;
+            }
+            while (*p && *p != ' ') {
+                p++;
+            }
+            if (hereDocs && *nextDoc < max_commands) {
+                growBuf* body = &hereDocs[(*nextDoc)++];
+                fd = bufferFd(body->data, body->len);
+            }
+        }
+
+        // Blank out the redirection so it is not passed as arguments
+        memset(start, ' ', p - start);
+    }
+    return fd;
+}
+
+//change directory function, returns the exit status
+int changeDir(char** args, int num_args){
     if (num_args != 2) {
             printf("Usage: cd <directory_name>\n");
+            return 2;
     } else {
-        if (chdir(parsedArgs[1]) != 0) {
+        if (chdir(args[1]) != 0) {
             perror("chdir");
+            return 1;
         }
     }
+    return 0;
 }
 
 //print command list
@@ -86,35 +510,1471 @@ void printHelp(){
     printf("5. addvec <filename1> <filename2> -<no_threads>\n");
     printf("6. subvec <filename1> <filename2> -<no_threads>\n");
     printf("7. dotprod <filename1> <filename2> -<no_threads>\n");
+    printf("   (vector files hold values, or sorted <index>:<value> pairs for sparse vectors)\n");
     printf("8. exit\n");
     printf("9. help\n");
+    printf("10. history [search <text>]\n");
+    printf("11. parallel [-j <no_jobs>] [--group] <command> {} ::: <args> | < <filename>\n");
+    printf("12. <name>=<value>, $<name>, ${<name>}, $(<command>)\n");
+    printf("13. with [--cpus <list>] [--nice <n>] [--ioprio idle|be[:n]|rt[:n]] [--rlimit <name>=<size>] <command>\n");
+    printf("14. timeout [-k <duration>] <duration> <command>\n");
 }
 
-//execute command
-void execute(char* command){
-    char* parsedArgs[max_args];
-    int num_args = processCommand(command, parsedArgs);
+// Function to append a string to a growable array of strings
+void appendString(char*** list, int* num, int* capacity, char* str) {
+    if (*num == *capacity) {
+        *capacity = (*capacity) ? 2 * (*capacity) : 16;
+        *list = (char**)realloc(*list, (*capacity) * sizeof(char*));
+    }
+    (*list)[(*num)++] = str;
+}
 
-    if(num_args == 0)
+// Function to read one argument per line from a stream
+void readArgLines(FILE* file, char*** args, int* num_args, int* capacity) {
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, file) >= 0) {
+        removeNewline(line);
+        if (line[0] != '\0') {
+            appendString(args, num_args, capacity, strdup(line));
+        }
+    }
+    free(line);
+}
+
+// Function to start one job, '{}' in the template is replaced by the argument (appended if absent)
+pid_t startJob(char** cmd, int num_cmd, parallelJob* job, int group) {
+    char* argv[num_cmd + 2];
+    int argc = 0;
+    int replaced = 0;
+    for (int i = 0; i < num_cmd; i++) {
+        if (!strstr(cmd[i], "{}")) {
+            argv[argc++] = cmd[i];
+            continue;
+        }
+        growBuf word = {NULL, 0, 0};
+        char* from = cmd[i];
+        char* at;
+        while ((at = strstr(from, "{}")) != NULL) {
+            bufAppend(&word, from, at - from);
+            bufAppend(&word, job->arg, strlen(job->arg));
+            from = at + 2;
+        }
+        bufAppend(&word, from, strlen(from));
+        argv[argc++] = word.data;
+        replaced = 1;
+    }
+    if (!replaced) {
+        argv[argc++] = job->arg;
+    }
+    argv[argc] = NULL;
+
+    job->outFd = group ? memfd_create("parallel", MFD_CLOEXEC) : -1;
+    job->pid = fork();
+    if (job->pid == 0) {
+        // Child process
+        if (job->outFd >= 0) {
+            dup2(job->outFd, STDOUT_FILENO);
+            dup2(job->outFd, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        perror("Could not execute command");
+        _exit(127);
+    }
+    if (job->pid < 0) {
+        perror("Failed forking child");
+    }
+    job->pidfd = (job->pid > 0) ? syscall(SYS_pidfd_open, job->pid, 0) : -1;
+
+    for (int i = 0; i < num_cmd; i++) {
+        if (argv[i] != cmd[i]) {
+            free(argv[i]);
+        }
+    }
+    return job->pid;
+}
+
+// Function to copy the grouped output of a finished job to stdout
+void flushJob(parallelJob* job) {
+    if (job->outFd < 0) {
         return;
+    }
+    char buffer[65536];
+    ssize_t n;
+    lseek(job->outFd, 0, SEEK_SET);
+    while ((n = read(job->outFd, buffer, sizeof(buffer))) > 0) {
+        if (write(STDOUT_FILENO, buffer, n) < 0) {
+            break;
+        }
+    }
+    close(job->outFd);
+    job->outFd = -1;
+}
+
+// Function to wait for a job that exited, or for the job alone without pidfd support, and print its output
+void reapJob(parallelJob* job) {
+    waitpid(job->pid, &job->status, 0);
+    if (job->pidfd >= 0) {
+        close(job->pidfd);
+    }
+    job->pid = 0;
+    flushJob(job);
+}
+
+// parallel builtin: keeps N jobs running and starts the next one as soon as any exits,
+// argInput holds the argument lines when neither ':::' nor '<' is given, NULL for none;
+// returns the number of failed jobs
+int parallelCommand(char** tokens, int num_tokens, FILE* argInput) {
+    // Options, then the command template, then the argument source
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int group = 0;
+    int t = 1;
+    for (; t < num_tokens && tokens[t][0] == '-'; t++) {
+        if (strcmp(tokens[t], "--group") == 0 || strcmp(tokens[t], "-g") == 0) {
+            group = 1;
+        } else if (strcmp(tokens[t], "-j") == 0 && t + 1 < num_tokens) {
+            slots = atoi(tokens[++t]);
+        } else if (strncmp(tokens[t], "-j", 2) == 0) {
+            slots = atoi(tokens[t] + 2);
+        } else {
+            break;
+        }
+    }
+    int first_cmd = t;
+    while (t < num_tokens && strcmp(tokens[t], ":::") != 0 && tokens[t][0] != '<') {
+        t++;
+    }
+    int num_cmd = t - first_cmd;
+
+    char** args = NULL;
+    int num_args = 0, arg_capacity = 0;
+    int have_args = (t < num_tokens || argInput);
+    if (t < num_tokens && strcmp(tokens[t], ":::") == 0) {
+        for (t++; t < num_tokens; t++) {
+            appendString(&args, &num_args, &arg_capacity, strdup(tokens[t]));
+        }
+    } else if (t < num_tokens) { // '< file' or '<file'
+        char* filename = tokens[t][1] ? tokens[t] + 1 : (t + 1 < num_tokens ? tokens[t + 1] : NULL);
+        FILE* file = filename ? fopen(filename, "r") : NULL;
+        if (!file) {
+            printf("Error: Cannot open argument file.\n");
+            return 1;
+        }
+        readArgLines(file, &args, &num_args, &arg_capacity);
+        fclose(file);
+    } else if (argInput) { // arguments piped from the previous stage
+        readArgLines(argInput, &args, &num_args, &arg_capacity);
+    }
+
+    if (num_cmd == 0 || slots < 1 || !have_args) {
+        printf("Usage: parallel [-j <no_jobs>] [--group] <command> {} ::: <args> | < <filename>\n");
+        free(args);
+        return 1;
+    }
+    if (slots > PARALLEL_MAX_SLOTS) {
+        slots = PARALLEL_MAX_SLOTS;
+    }
+
+    parallelJob* jobs = (parallelJob*)calloc(num_args ? num_args : 1, sizeof(parallelJob));
+    int next = 0, running = 0, failed = 0;
+    int oldest = 0; // jobs before it have all been reaped
+    fflush(stdout); // children must not inherit buffered output
+
+    while (next < num_args || running > 0) {
+        if (next < num_args && running < slots) {
+            jobs[next].arg = args[next];
+            if (startJob(tokens + first_cmd, num_cmd, &jobs[next], group) > 0) {
+                running++;
+            } else {
+                jobs[next].status = 127 << 8;
+            }
+            next++;
+            continue;
+        }
+
+        // A slot frees up as soon as any job exits, polled through the pidfds of the jobs so that
+        // other children of the shell, such as pipeline stages around a $( ), are not reaped here
+        struct pollfd fds[PARALLEL_MAX_SLOTS];
+        int index[PARALLEL_MAX_SLOTS];
+        int num_fds = 0, no_pidfd = -1;
+        while (oldest < next && jobs[oldest].pid <= 0) {
+            oldest++;
+        }
+        for (int i = oldest; i < next && num_fds < PARALLEL_MAX_SLOTS; i++) {
+            if (jobs[i].pid > 0) {
+                no_pidfd = (jobs[i].pidfd < 0 && no_pidfd < 0) ? i : no_pidfd;
+                fds[num_fds].fd = jobs[i].pidfd;
+                fds[num_fds].events = POLLIN;
+                index[num_fds++] = i;
+            }
+        }
+        if (no_pidfd >= 0) {
+            reapJob(&jobs[no_pidfd]);
+            running--;
+            continue;
+        }
+        if (poll(fds, num_fds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        for (int f = 0; f < num_fds; f++) {
+            if (fds[f].revents & (POLLIN | POLLHUP)) {
+                reapJob(&jobs[index[f]]);
+                running--;
+            }
+        }
+    }
+    for (int i = oldest; i < next; i++) { // left running by a poll failure
+        if (jobs[i].pid > 0) {
+            reapJob(&jobs[i]);
+        }
+    }
 
-    if(execvp(parsedArgs[0], parsedArgs) < 0){
+    // Per-job exit status summary
+    for (int i = 0; i < num_args; i++) {
+        if (WIFSIGNALED(jobs[i].status)) {
+            fprintf(stderr, "[%d] killed by signal %d: %s\n", i + 1, WTERMSIG(jobs[i].status), jobs[i].arg);
+            failed++;
+        } else if (WEXITSTATUS(jobs[i].status) != 0) {
+            fprintf(stderr, "[%d] exit %d: %s\n", i + 1, WEXITSTATUS(jobs[i].status), jobs[i].arg);
+            failed++;
+        }
+        free(args[i]);
+    }
+    fprintf(stderr, "parallel: %d jobs, %d succeeded, %d failed\n", num_args, num_args - failed, failed);
+
+    free(jobs);
+    free(args);
+    return failed;
+}
+
+// Function to compile a glob pattern component, returns the number of tokens
+int compileGlob(const char* pattern, globToken* tokens) {
+    int n = 0;
+    for (const char* p = pattern; *p; p++) {
+        globToken* token = &tokens[n++];
+        // The ']' closing a set must be in this component, one right after the bracket is literal
+        const char* close = (*p == '[' && p[1]) ? strpbrk(p + 2, "]/") : NULL;
+        if (*p == '*') {
+            token->type = GLOB_STAR;
+            while (p[1] == '*') {
+                p++;
+            }
+        } else if (*p == '?') {
+            token->type = GLOB_ANY;
+        } else if (*p == '\\' && p[1]) { // escaped by tokenizeCommand
+            token->type = GLOB_CHAR;
+            token->c = *++p;
+        } else if (close && *close == ']') {
+            // [abc], [a-z], [!a] or [^a]
+            const char* q = p + 1;
+            int negate = (*q == '!' || *q == '^');
+            if (negate) {
+                q++;
+            }
+            token->type = GLOB_SET;
+            memset(token->set, 0, sizeof(token->set));
+            do {
+                unsigned char lo = *q, hi = *q;
+                if (q[1] == '-' && q[2] && q[2] != ']') {
+                    hi = q[2];
+                    q += 2;
+                }
+                for (int c = lo; c <= hi; c++) {
+                    token->set[c >> 3] |= 1 << (c & 7);
+                }
+                q++;
+            } while (*q && *q != ']');
+            if (!*q) { // unterminated after all, match the bracket literally
+                token->type = GLOB_CHAR;
+                token->c = '[';
+                continue;
+            }
+            if (negate) {
+                for (int i = 0; i < 32; i++) {
+                    token->set[i] = ~token->set[i];
+                }
+            }
+            p = q;
+        } else {
+            token->type = GLOB_CHAR;
+            token->c = *p;
+        }
+    }
+    return n;
+}
+
+// Function to match a name against a compiled pattern, backtracking only to the last '*'
+int matchGlob(const globToken* tokens, int n, const char* name) {
+    if (name[0] == '.' && !(n > 0 && tokens[0].type == GLOB_CHAR && tokens[0].c == '.')) {
+        return 0; // hidden files need an explicit leading dot
+    }
+
+    int t = 0, star_t = -1;
+    const char* s = name;
+    const char* star_s = NULL;
+    while (*s) {
+        if (t < n && tokens[t].type == GLOB_STAR) {
+            star_t = t++;
+            star_s = s;
+            continue;
+        }
+        if (t < n && (tokens[t].type == GLOB_ANY ||
+                      (tokens[t].type == GLOB_CHAR && tokens[t].c == *s) ||
+                      (tokens[t].type == GLOB_SET && (tokens[t].set[(unsigned char)*s >> 3] & (1 << (*s & 7)))))) {
+            t++;
+            s++;
+            continue;
+        }
+        if (star_t < 0) {
+            return 0;
+        }
+        t = star_t + 1; // let the last '*' swallow one more character
+        s = ++star_s;
+    }
+    while (t < n && tokens[t].type == GLOB_STAR) {
+        t++;
+    }
+    return t == n;
+}
+
+// Function to list a directory, served from the cache while the directory mtime is unchanged
+dirListing* listDirectory(const char* path) {
+    struct stat st;
+    if (stat(path[0] ? path : ".", &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    dirListing* slot = &dirCache[0];
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        dirListing* entry = &dirCache[i];
+        if (entry->lastUse && entry->dev == st.st_dev && entry->ino == st.st_ino) {
+            if (entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                entry->lastUse = ++dirCacheClock;
+                return entry;
+            }
+            slot = entry; // stale listing, read it again in place
+            break;
+        }
+        if (entry->lastUse < slot->lastUse) {
+            slot = entry; // least recently used
+        }
+    }
+
+    int fd = open(path[0] ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    slot->names.len = 0;
+    slot->numEntries = 0;
+    int capacity = 0;
+    char* buffer = (char*)malloc(DENTS_BUFFER);
+    ssize_t n;
+    while ((n = getdents64(fd, buffer, DENTS_BUFFER)) > 0) {
+        for (ssize_t pos = 0; pos < n;) {
+            struct dirent64* dent = (struct dirent64*)(buffer + pos);
+            pos += dent->d_reclen;
+            if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+                continue;
+            }
+            if (slot->numEntries == capacity) {
+                capacity = capacity ? 2 * capacity : 256;
+                slot->offsets = (int*)realloc(slot->offsets, capacity * sizeof(int));
+                slot->types = (unsigned char*)realloc(slot->types, capacity);
+            }
+            slot->offsets[slot->numEntries] = slot->names.len;
+            slot->types[slot->numEntries] = dent->d_type;
+            slot->numEntries++;
+            bufAppend(&slot->names, dent->d_name, strlen(dent->d_name) + 1);
+        }
+    }
+    free(buffer);
+    close(fd);
+
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->lastUse = ++dirCacheClock;
+    return slot;
+}
+
+// Function to tell whether an entry of a listing is a directory, following symlinks if asked
+int isDirectory(const char* path, unsigned char type, int follow) {
+    struct stat st;
+    if (type == DT_DIR) {
+        return 1;
+    }
+    if (type == DT_UNKNOWN || (type == DT_LNK && follow)) {
+        return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    return 0;
+}
+
+// Function to expand the path components of a glob starting at 'idx' under the directory 'base'
+void globPath(growBuf* base, char** comps, int num_comps, int idx, char*** matches, int* num_matches, int* capacity) {
+    if (idx == num_comps) { // reached through 'dir/**/', the directory itself matches
+        if (base->len > 1) {
+            appendString(matches, num_matches, capacity, strndup(base->data, base->len - 1));
+        }
+        return;
+    }
+    size_t base_len = base->len;
+    char* comp = comps[idx];
+
+    if (!strpbrk(comp, "*?[")) { // literal component
+        for (const char* c = comp; *c; c++) {
+            if (*c == '\\' && c[1]) { // escaped by tokenizeCommand
+                c++;
+            }
+            bufAppend(base, c, 1);
+        }
+        struct stat st;
+        if (idx == num_comps - 1) {
+            if (lstat(base->data, &st) == 0) {
+                appendString(matches, num_matches, capacity, strdup(base->data));
+            }
+        } else if (stat(base->data, &st) == 0 && S_ISDIR(st.st_mode)) {
+            bufAppend(base, "/", 1);
+            globPath(base, comps, num_comps, idx + 1, matches, num_matches, capacity);
+        }
+    } else if (strcmp(comp, "**") == 0) { // zero or more directories, symlinks are not followed
+        int last = (idx == num_comps - 1); // a trailing '**' also matches the files
+        if (!last) {
+            globPath(base, comps, num_comps, idx + 1, matches, num_matches, capacity);
+        }
+        dirListing* listing = listDirectory(base->data);
+        if (!listing) {
+            return;
+        }
+
+        // The recursion may evict the listing, keep a copy
+        int num_entries = listing->numEntries;
+        char* names = (char*)malloc(listing->names.len + 1);
+        int* offsets = (int*)malloc(num_entries * sizeof(int) + 1);
+        unsigned char* types = (unsigned char*)malloc(num_entries + 1);
+        memcpy(names, listing->names.data, listing->names.len);
+        memcpy(offsets, listing->offsets, num_entries * sizeof(int));
+        memcpy(types, listing->types, num_entries);
+
+        for (int i = 0; i < num_entries; i++) {
+            char* name = names + offsets[i];
+            if (name[0] == '.') {
+                continue;
+            }
+            bufAppend(base, name, strlen(name));
+            if (last) {
+                appendString(matches, num_matches, capacity, strdup(base->data));
+            }
+            if (isDirectory(base->data, types[i], 0)) {
+                bufAppend(base, "/", 1);
+                globPath(base, comps, num_comps, idx, matches, num_matches, capacity);
+            }
+            base->len = base_len;
+            base->data[base_len] = '\0';
+        }
+        free(names);
+        free(offsets);
+        free(types);
+    } else {
+        globToken tokens[strlen(comp) + 1];
+        int num_tokens = compileGlob(comp, tokens);
+        dirListing* listing = listDirectory(base->data);
+        if (!listing) {
+            return;
+        }
+
+        // Collect the matching names first, the recursion may evict the listing
+        char** names = NULL;
+        int num_names = 0, names_capacity = 0;
+        for (int i = 0; i < listing->numEntries; i++) {
+            char* name = listing->names.data + listing->offsets[i];
+            if (!matchGlob(tokens, num_tokens, name)) {
+                continue;
+            }
+            if (idx == num_comps - 1) {
+                bufAppend(base, name, strlen(name));
+                appendString(matches, num_matches, capacity, strdup(base->data));
+                base->len = base_len;
+                base->data[base_len] = '\0';
+            } else {
+                bufAppend(base, name, strlen(name));
+                if (isDirectory(base->data, listing->types[i], 1)) {
+                    appendString(&names, &num_names, &names_capacity, strdup(base->data + base_len));
+                }
+                base->len = base_len;
+                base->data[base_len] = '\0';
+            }
+        }
+        for (int i = 0; i < num_names; i++) {
+            bufAppend(base, names[i], strlen(names[i]));
+            bufAppend(base, "/", 1);
+            globPath(base, comps, num_comps, idx + 1, matches, num_matches, capacity);
+            base->len = base_len;
+            base->data[base_len] = '\0';
+            free(names[i]);
+        }
+        free(names);
+    }
+    base->len = base_len;
+    base->data[base_len] = '\0';
+}
+
+// Function to compare two strings for qsort
+int compareStrings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Function to expand a glob word, the matching paths are appended to a list of words in sorted order;
+// returns their number
+int expandGlob(const char* pattern, char*** words, int* num_words, int* capacity) {
+    char* word = strdup(pattern);
+    char** comps = NULL;
+    int num_comps = 0, comps_capacity = 0;
+    char* saveptr;
+    for (char* comp = strtok_r(word, "/", &saveptr); comp; comp = strtok_r(NULL, "/", &saveptr)) {
+        appendString(&comps, &num_comps, &comps_capacity, comp);
+    }
+    growBuf base = {NULL, 0, 0};
+    bufAppend(&base, pattern[0] == '/' ? "/" : "", pattern[0] == '/');
+
+    char** matches = NULL;
+    int num_matches = 0, matches_capacity = 0;
+    globPath(&base, comps, num_comps, 0, &matches, &num_matches, &matches_capacity);
+
+    // A trailing slash only keeps the directories
+    if (pattern[strlen(pattern) - 1] == '/') {
+        int kept = 0;
+        for (int i = 0; i < num_matches; i++) {
+            if (isDirectory(matches[i], DT_UNKNOWN, 1)) {
+                matches[kept] = (char*)realloc(matches[i], strlen(matches[i]) + 2);
+                strcat(matches[kept++], "/");
+            } else {
+                free(matches[i]);
+            }
+        }
+        num_matches = kept;
+    }
+    qsort(matches, num_matches, sizeof(char*), compareStrings);
+    for (int i = 0; i < num_matches; i++) {
+        appendString(words, num_words, capacity, matches[i]);
+    }
+    free(matches);
+    free(comps);
+    free(base.data);
+    free(word);
+    return num_matches;
+}
+
+// Function to print the working directory
+int pwdBuiltin() {
+    char* cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+// Function to create directories, with 'parents' missing parents are created and existing ones accepted
+int mkdirBuiltin(char** paths, int num_paths, int parents) {
+    int status = 0;
+    for (int i = 0; i < num_paths; i++) {
+        if (paths[i][0] == '\0') { // e.g. an unset variable
+            fprintf(stderr, "mkdir: cannot create directory '': %s\n", strerror(ENOENT));
+            status = 1;
+            continue;
+        }
+        if (parents) {
+            for (char* slash = strchr(paths[i] + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+                *slash = '\0';
+                int failed = (mkdir(paths[i], 0777) != 0 && errno != EEXIST);
+                *slash = '/';
+                if (failed) {
+                    break; // reported by the final mkdir below
+                }
+            }
+        }
+        if (mkdir(paths[i], 0777) != 0 && !(parents && errno == EEXIST && isDirectory(paths[i], DT_UNKNOWN, 1))) {
+            fprintf(stderr, "mkdir: cannot create directory '%s': %s\n", paths[i], strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Function to append one 'ls -l' line, the owner and group names of the last lookup are reused
+void formatLong(growBuf* out, int dirfd, const char* name, const struct statx* stx) {
+    static uid_t last_uid = -1;
+    static gid_t last_gid = -1;
+    static char user[32], group[32];
+
+    char mode[11] = "?---------";
+    switch (stx->stx_mode & S_IFMT) {
+        case S_IFREG: mode[0] = '-'; break;
+        case S_IFDIR: mode[0] = 'd'; break;
+        case S_IFLNK: mode[0] = 'l'; break;
+        case S_IFCHR: mode[0] = 'c'; break;
+        case S_IFBLK: mode[0] = 'b'; break;
+        case S_IFIFO: mode[0] = 'p'; break;
+        case S_IFSOCK: mode[0] = 's'; break;
+    }
+    const char* rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; i++) {
+        if (stx->stx_mode & (0400 >> i)) {
+            mode[i + 1] = rwx[i];
+        }
+    }
+    if (stx->stx_mode & S_ISUID) mode[3] = (mode[3] == 'x') ? 's' : 'S';
+    if (stx->stx_mode & S_ISGID) mode[6] = (mode[6] == 'x') ? 's' : 'S';
+    if (stx->stx_mode & S_ISVTX) mode[9] = (mode[9] == 'x') ? 't' : 'T';
+
+    if (stx->stx_uid != last_uid) {
+        struct passwd* pw = getpwuid(stx->stx_uid);
+        if (pw) {
+            snprintf(user, sizeof(user), "%s", pw->pw_name);
+        } else {
+            snprintf(user, sizeof(user), "%u", stx->stx_uid);
+        }
+        last_uid = stx->stx_uid;
+    }
+    if (stx->stx_gid != last_gid) {
+        struct group* gr = getgrgid(stx->stx_gid);
+        if (gr) {
+            snprintf(group, sizeof(group), "%s", gr->gr_name);
+        } else {
+            snprintf(group, sizeof(group), "%u", stx->stx_gid);
+        }
+        last_gid = stx->stx_gid;
+    }
+
+    // Recent files show the time, older ones the year
+    char date[32];
+    time_t mtime = stx->stx_mtime.tv_sec;
+    struct tm tm;
+    localtime_r(&mtime, &tm);
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), (now - mtime < 15778476 && mtime <= now) ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+
+    char line[256];
+    int n = snprintf(line, sizeof(line), "%s %3u %-8s %-8s %8llu %s ", mode, stx->stx_nlink, user, group, (unsigned long long)stx->stx_size, date);
+    bufAppend(out, line, n);
+    bufAppend(out, name, strlen(name));
+    if (S_ISLNK(stx->stx_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(dirfd, name, target, sizeof(target));
+        if (len > 0) {
+            bufAppend(out, " -> ", 4);
+            bufAppend(out, target, len);
+        }
+    }
+    bufAppend(out, "\n", 1);
+}
+
+// Function to append names in columns when writing to a terminal, one per line otherwise
+void formatNames(growBuf* out, char** names, int num_names, int one_per_line) {
+    struct winsize ws;
+    int width = 0;
+    for (int i = 0; i < num_names; i++) {
+        int len = strlen(names[i]);
+        width = (len > width) ? len : width;
+    }
+    int columns = 1;
+    if (!one_per_line && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        columns = ws.ws_col / (width + 2);
+        columns = (columns < 1) ? 1 : columns;
+    }
+    int rows = (num_names + columns - 1) / columns;
+
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < columns; c++) {
+            int i = c * rows + r; // names run down the columns
+            if (i >= num_names) {
+                break;
+            }
+            int len = strlen(names[i]);
+            bufAppend(out, names[i], len);
+            for (int pad = len; columns > 1 && (c + 1) * rows + r < num_names && pad < width + 2; pad++) {
+                bufAppend(out, " ", 1);
+            }
+        }
+        bufAppend(out, "\n", 1);
+    }
+}
+
+// Function to list one directory, statx is only called for -l and only asks for the printed fields
+int listOne(growBuf* out, const char* path, int all, int long_format, int one_per_line) {
+    dirListing* listing = listDirectory(path);
+    if (!listing) {
+        fprintf(stderr, "ls: cannot access '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    char** names = NULL;
+    int num_names = 0, capacity = 0;
+    if (all) {
+        appendString(&names, &num_names, &capacity, ".");
+        appendString(&names, &num_names, &capacity, "..");
+    }
+    for (int i = 0; i < listing->numEntries; i++) {
+        char* name = listing->names.data + listing->offsets[i];
+        if (all || name[0] != '.') {
+            appendString(&names, &num_names, &capacity, name);
+        }
+    }
+    qsort(names, num_names, sizeof(char*), compareStrings);
+
+    if (!long_format) {
+        formatNames(out, names, num_names, one_per_line);
+    } else {
+        int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct statx* stx = (struct statx*)malloc((num_names + 1) * sizeof(struct statx));
+        unsigned long long blocks = 0;
+        for (int i = 0; i < num_names; i++) {
+            if (statx(dirfd, names[i], AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, LS_LONG_MASK, &stx[i]) != 0) {
+                memset(&stx[i], 0, sizeof(struct statx));
+            }
+            blocks += stx[i].stx_blocks;
+        }
+        char total[32];
+        bufAppend(out, total, snprintf(total, sizeof(total), "total %llu\n", blocks / 2));
+        for (int i = 0; i < num_names; i++) {
+            formatLong(out, dirfd, names[i], &stx[i]);
+        }
+        free(stx);
+        close(dirfd);
+    }
+    free(names);
+    return 0;
+}
+
+// Function to list files and directories, returns -1 for options left to the ls binary
+int lsBuiltin(char** args, int num_args) {
+    int all = 0, long_format = 0, one_per_line = !isatty(STDOUT_FILENO);
+    char** paths = NULL;
+    int num_paths = 0, capacity = 0;
+    for (int i = 1; i < num_args; i++) {
+        if (args[i][0] == '-' && args[i][1]) {
+            for (char* flag = args[i] + 1; *flag; flag++) {
+                if (*flag == 'a') all = 1;
+                else if (*flag == 'l') long_format = 1;
+                else if (*flag == '1') one_per_line = 1;
+                else {
+                    free(paths);
+                    return -1;
+                }
+            }
+        } else {
+            appendString(&paths, &num_paths, &capacity, args[i]);
+        }
+    }
+    if (num_paths == 0) {
+        appendString(&paths, &num_paths, &capacity, ".");
+    }
+    qsort(paths, num_paths, sizeof(char*), compareStrings);
+
+    growBuf out = {NULL, 0, 0};
+    bufAppend(&out, "", 0);
+    int status = 0;
+
+    // Files first, then each directory under a header when there are several
+    char** files = NULL;
+    char** dirs = NULL;
+    int num_files = 0, files_capacity = 0, num_dirs = 0, dirs_capacity = 0;
+    for (int i = 0; i < num_paths; i++) {
+        struct statx stx;
+        int flags = AT_NO_AUTOMOUNT | (long_format ? AT_SYMLINK_NOFOLLOW : 0);
+        if (statx(AT_FDCWD, paths[i], flags, long_format ? LS_LONG_MASK : STATX_TYPE, &stx) != 0) {
+            fprintf(stderr, "ls: cannot access '%s': %s\n", paths[i], strerror(errno));
+            status = 2;
+        } else if (S_ISDIR(stx.stx_mode)) {
+            appendString(&dirs, &num_dirs, &dirs_capacity, paths[i]);
+        } else {
+            appendString(&files, &num_files, &files_capacity, paths[i]);
+            if (long_format) {
+                formatLong(&out, AT_FDCWD, paths[i], &stx);
+            }
+        }
+    }
+    if (!long_format) {
+        formatNames(&out, files, num_files, one_per_line);
+    }
+    for (int i = 0; i < num_dirs; i++) {
+        if (num_paths > 1) {
+            if (i > 0 || num_files > 0) {
+                bufAppend(&out, "\n", 1);
+            }
+            bufAppend(&out, dirs[i], strlen(dirs[i]));
+            bufAppend(&out, ":\n", 2);
+        }
+        status |= listOne(&out, dirs[i], all, long_format, one_per_line);
+    }
+
+    // The whole listing goes out in one write
+    fflush(stdout);
+    size_t done = 0;
+    while (done < out.len) {
+        ssize_t n = write(STDOUT_FILENO, out.data + done, out.len - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    free(out.data);
+    free(files);
+    free(dirs);
+    free(paths);
+    return status;
+}
+
+// Function to run pwd, mkdir and ls without forking, returns -1 if the command has to be exec'd
+int fastBuiltin(char** args, int num_args) {
+    int status = -1;
+    if (num_args == 0) {
+        return status;
+    } else if (strcmp(args[0], "pwd") == 0) {
+        status = pwdBuiltin();
+    } else if (strcmp(args[0], "mkdir") == 0) {
+        int parents = (num_args > 1 && strcmp(args[1], "-p") == 0);
+        int options = 0; // other options anywhere are left to the binary
+        for (int i = 1 + parents; i < num_args; i++) {
+            options |= (args[i][0] == '-');
+        }
+        if (num_args > 1 + parents && !options) {
+            status = mkdirBuiltin(args + 1 + parents, num_args - 1 - parents, parents);
+        }
+    } else if (strcmp(args[0], "ls") == 0) {
+        status = lsBuiltin(args, num_args);
+    }
+    fflush(stdout);
+    return status;
+}
+
+// Function to parse a size such as 512, 64K, 4G or unlimited
+int parseSize(const char* text, rlim_t* value) {
+    if (strcmp(text, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return 1;
+    }
+    char* end;
+    unsigned long long n = strtoull(text, &end, 10);
+    if (end == text) {
+        return 0;
+    }
+    switch (*end) {
+        case 'T': case 't': n <<= 10; /* fall through */
+        case 'G': case 'g': n <<= 10; /* fall through */
+        case 'M': case 'm': n <<= 10; /* fall through */
+        case 'K': case 'k': n <<= 10; end++; break;
+    }
+    *value = n;
+    return *end == '\0';
+}
+
+// Function to parse 'with [--cpus LIST] [--nice N] [--ioprio CLASS[:LEVEL]] [--rlimit NAME=SIZE] cmd',
+// returns the index of the first word of the command, 0 if there is no prefix, or -1 on errors
+int parseWith(char** words, int num_words, schedPolicy* policy) {
+    static const char* limit_names[] = {"as", "cpu", "data", "fsize", "nofile", "nproc", "stack", "core", "memlock"};
+    static const int limit_resources[] = {RLIMIT_AS, RLIMIT_CPU, RLIMIT_DATA, RLIMIT_FSIZE, RLIMIT_NOFILE, RLIMIT_NPROC, RLIMIT_STACK, RLIMIT_CORE, RLIMIT_MEMLOCK};
+
+    memset(policy, 0, sizeof(*policy));
+    if (num_words == 0 || strcmp(words[0], "with") != 0) {
+        return 0;
+    }
+
+    int w = 1;
+    while (w < num_words && strncmp(words[w], "--", 2) == 0) {
+        char* option = words[w++];
+        char* value = (w < num_words) ? words[w++] : NULL;
+        if (!value) {
+            printf("Error: Missing value for %s\n", option);
+            return -1;
+        }
+
+        if (strcmp(option, "--cpus") == 0) { // e.g. 0-3,6
+            policy->set_cpus = 1;
+            CPU_ZERO(&policy->cpus);
+            for (char* range = value; *range;) {
+                char* end;
+                long lo = strtol(range, &end, 10), hi = lo;
+                if (*end == '-') {
+                    hi = strtol(end + 1, &end, 10);
+                }
+                if (end == range || lo < 0 || hi < lo || hi >= CPU_SETSIZE || (*end && *end != ',')) {
+                    printf("Error: Invalid cpu list '%s'\n", value);
+                    return -1;
+                }
+                for (long cpu = lo; cpu <= hi; cpu++) {
+                    CPU_SET(cpu, &policy->cpus);
+                }
+                range = *end ? end + 1 : end;
+            }
+        } else if (strcmp(option, "--nice") == 0) {
+            policy->set_nice = 1;
+            policy->nice = atoi(value);
+        } else if (strcmp(option, "--ioprio") == 0) { // idle, be[:0-7] or rt[:0-7]
+            int level = strchr(value, ':') ? atoi(strchr(value, ':') + 1) : 4;
+            int ioclass = (strncmp(value, "rt", 2) == 0) ? 1 : (strncmp(value, "be", 2) == 0) ? 2 : (strncmp(value, "idle", 4) == 0) ? 3 : 0;
+            if (ioclass == 0 || level < 0 || level > 7) {
+                printf("Error: Invalid I/O priority '%s'\n", value);
+                return -1;
+            }
+            policy->set_ioprio = 1;
+            policy->ioprio = (ioclass << IOPRIO_CLASS_SHIFT) | (ioclass == 3 ? 0 : level);
+        } else if (strcmp(option, "--rlimit") == 0) { // e.g. as=4G
+            char* size = strchr(value, '=');
+            int r = 0;
+            while (size && r < (int)(sizeof(limit_names) / sizeof(limit_names[0])) &&
+                   !((int)strlen(limit_names[r]) == size - value && strncmp(limit_names[r], value, size - value) == 0)) {
+                r++;
+            }
+            rlim_t limit;
+            if (!size || r == (int)(sizeof(limit_names) / sizeof(limit_names[0])) || !parseSize(size + 1, &limit) || policy->num_limits == MAX_RLIMITS) {
+                printf("Error: Invalid resource limit '%s'\n", value);
+                return -1;
+            }
+            policy->limit_resource[policy->num_limits] = limit_resources[r];
+            policy->limit_value[policy->num_limits] = limit;
+            policy->num_limits++;
+        } else {
+            printf("Usage: with [--cpus <list>] [--nice <n>] [--ioprio idle|be[:n]|rt[:n]] [--rlimit <name>=<size>] <command>\n");
+            return -1;
+        }
+    }
+    return w;
+}
+
+// Function to apply a policy to the calling thread, the resource limits are process wide and optional
+int applyPolicy(const schedPolicy* policy, int with_limits) {
+    int status = 0;
+    if (policy->set_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &policy->cpus) != 0) {
+        perror("sched_setaffinity");
+        status = -1;
+    }
+    if (policy->set_nice) {
+        errno = 0;
+        int current = getpriority(PRIO_PROCESS, 0);
+        if (errno != 0 || setpriority(PRIO_PROCESS, 0, current + policy->nice) != 0) {
+            perror("setpriority");
+            status = -1;
+        }
+    }
+    if (policy->set_ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, policy->ioprio) != 0) {
+        perror("ioprio_set");
+        status = -1;
+    }
+    for (int i = 0; with_limits && i < policy->num_limits; i++) {
+        struct rlimit limit = {policy->limit_value[i], policy->limit_value[i]};
+        if (setrlimit(policy->limit_resource[i], &limit) != 0) {
+            perror("setrlimit");
+            status = -1;
+        }
+    }
+    return status;
+}
+
+//execute command, pipedInput is set when stdin comes from a pipe or a here-document
+void execute(char** words, int num_words, int pipedInput){
+    // A 'with' prefix is applied here, between fork and exec
+    schedPolicy policy;
+    int first = parseWith(words, num_words, &policy);
+    if (first < 0 || applyPolicy(&policy, 1) != 0) {
+        exit(1);
+    }
+    words += first;
+    num_words -= first;
+    if(num_words == 0)
+        return;
+
+    if (strcmp(words[0], "parallel") == 0) { // builtin used as a pipeline stage
+        exit(parallelCommand(words, num_words, pipedInput ? stdin : NULL) ? 1 : 0);
+    }
+    int status = fastBuiltin(words, num_words);
+    if (status >= 0) { // pwd, mkdir and ls need no exec
+        exit(status);
+    }
+
+    // The words are NULL terminated and not limited to max_args, a glob may expand to many files
+    if(execvp(words[0], words) < 0){
         perror("Could not execute command");
         exit(1);
     }
 
-    exit(0);
+    exit(0);
+}
+
+// Function to prepare the search pattern and its shift table
+void compileSearch(viSearch* search, const char* pattern, int ignoreCase) {
+    strncpy(search->pattern, pattern, MAX_PATTERN - 1);
+    search->pattern[MAX_PATTERN - 1] = '\0';
+    search->patLen = strlen(search->pattern);
+    search->ignoreCase = ignoreCase;
+
+    for (int i = 0; i < search->patLen && ignoreCase; i++) {
+        search->pattern[i] = tolower((unsigned char)search->pattern[i]);
+    }
+    for (int i = 0; i < 256; i++) {
+        search->shift[i] = search->patLen;
+    }
+    // Both cases get the same shift, so the text never has to be folded to skip
+    for (int i = 0; i < search->patLen - 1; i++) {
+        unsigned char c = search->pattern[i];
+        search->shift[c] = search->patLen - 1 - i;
+        if (ignoreCase) {
+            search->shift[toupper(c)] = search->patLen - 1 - i;
+        }
+    }
+}
+
+// Function to find the pattern in a line starting at 'from', returns the position or -1
+int searchLine(const viSearch* search, const char* text, int textLen, int from) {
+    int m = search->patLen;
+    if (m == 0 || textLen - from < m) {
+        return -1;
+    }
+    if (m == 1 && !search->ignoreCase) { // single character, let memchr do the scan
+        const char* p = memchr(text + from, search->pattern[0], textLen - from);
+        return p ? (int)(p - text) : -1;
+    }
+
+    int i = from;
+    while (i <= textLen - m) {
+        int j = m - 1;
+        if (search->ignoreCase) {
+            while (j >= 0 && tolower((unsigned char)text[i + j]) == (unsigned char)search->pattern[j])
+                j--;
+        } else {
+            while (j >= 0 && text[i + j] == search->pattern[j])
+                j--;
+        }
+        if (j < 0) {
+            return i;
+        }
+        i += search->shift[(unsigned char)text[i + m - 1]];
+    }
+    return -1;
+}
+
+// Function to replace the matches in a line, returns the new line or NULL if nothing matched
+char* replaceLine(const viSearch* search, const char* line, const char* replacement, int global, int* count) {
+    int len = strlen(line);
+    int pos = searchLine(search, line, len, 0);
+    if (pos < 0) {
+        return NULL;
+    }
+
+    int repLen = strlen(replacement);
+    int capacity = len + repLen + 1;
+    char* result = (char*)malloc(capacity);
+    int size = 0;
+    int from = 0;
+
+    while (pos >= 0) {
+        if (size + (pos - from) + repLen + 1 > capacity) {
+            capacity = 2 * capacity + (pos - from) + repLen;
+            result = (char*)realloc(result, capacity);
+        }
+        memcpy(result + size, line + from, pos - from);
+        size += pos - from;
+        memcpy(result + size, replacement, repLen);
+        size += repLen;
+        from = pos + search->patLen;
+        (*count)++;
+        pos = global ? searchLine(search, line, len, from) : -1;
+    }
+
+    if (size + (len - from) + 1 > capacity) {
+        capacity = size + (len - from) + 1;
+        result = (char*)realloc(result, capacity);
+    }
+    memcpy(result + size, line + from, len - from + 1);
+    return result;
+}
+
+// count matches function for threads
+void* count_matches(void* args) {
+    struct SearchArgs* sargs = (struct SearchArgs*)args;
+    sargs->count = 0;
+    for (int i = sargs->start_idx; i < sargs->end_idx; i++) {
+        int len = strlen(sargs->lines[i]);
+        int pos = searchLine(sargs->search, sargs->lines[i], len, 0);
+        while (pos >= 0) {
+            sargs->count++;
+            pos = searchLine(sargs->search, sargs->lines[i], len, pos + sargs->search->patLen);
+        }
+    }
+    pthread_exit(NULL);
+}
+
+// replace matches function for threads, each thread only touches its own lines
+void* replace_matches(void* args) {
+    struct SearchArgs* sargs = (struct SearchArgs*)args;
+    sargs->count = 0;
+    for (int i = sargs->start_idx; i < sargs->end_idx; i++) {
+        char* newLine = replaceLine(sargs->search, sargs->lines[i], sargs->replacement, sargs->global, &sargs->count);
+        if (newLine) {
+            if (sargs->oldLines) {
+                sargs->oldLines[i] = sargs->lines[i];
+            } else {
+                free(sargs->lines[i]);
+            }
+            sargs->lines[i] = newLine;
+        }
+    }
+    pthread_exit(NULL);
+}
+
+// Function to split the buffer across threads, returns the total number of matches
+int searchBuffer(viSearch* search, char** lines, int numLines, void* (*worker)(void*), const char* replacement, int global, char** oldLines) {
+    int num_threads = numLines / SEARCH_LINES_PER_THREAD + 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && num_threads > cpus) {
+        num_threads = cpus;
+    }
+    if (num_threads > MAX_SEARCH_THREADS) {
+        num_threads = MAX_SEARCH_THREADS;
+    }
+
+    pthread_t threads[MAX_SEARCH_THREADS];
+    struct SearchArgs sargs[MAX_SEARCH_THREADS];
+    int chunk_size = numLines / num_threads; // amount of lines assigned to each thread
+
+    for (int i = 0; i < num_threads; i++) {
+        sargs[i].search = search;
+        sargs[i].lines = lines;
+        sargs[i].oldLines = oldLines;
+        sargs[i].replacement = replacement;
+        sargs[i].global = global;
+        sargs[i].start_idx = i * chunk_size;
+        sargs[i].end_idx = (i == num_threads - 1) ? numLines : (i + 1) * chunk_size;
+        pthread_create(&threads[i], NULL, worker, &sargs[i]);
+    }
+
+    int total = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        total += sargs[i].count;
+    }
+    return total;
+}
+
+// Function to move the cursor to the next match, wrapping around the buffer
+int findNext(viSearch* search, char** lines, int numLines, int* cursorX, int* cursorY, int backward) {
+    if (!backward) {
+        for (int n = 0; n <= numLines; n++) {
+            int y = (*cursorY + n) % numLines;
+            int from = (n == 0) ? *cursorX + 1 : 0;
+            int len = strlen(lines[y]);
+            int pos = (from <= len) ? searchLine(search, lines[y], len, from) : -1;
+            if (pos >= 0) {
+                *cursorX = pos;
+                *cursorY = y;
+                return 1;
+            }
+        }
+    } else {
+        for (int n = 0; n <= numLines; n++) {
+            int y = ((*cursorY - n) % numLines + numLines) % numLines;
+            int len = strlen(lines[y]);
+            int last = -1;
+            int pos = searchLine(search, lines[y], len, 0);
+            // Keep the last match before the cursor on the starting line
+            while (pos >= 0 && !(n == 0 && pos >= *cursorX)) {
+                last = pos;
+                pos = searchLine(search, lines[y], len, pos + 1);
+            }
+            if (last >= 0) {
+                *cursorX = last;
+                *cursorY = y;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to read a command on the status line
+int promptLine(const char* prompt, char* buffer, int size) {
+    move(LINES - 1, 0);
+    clrtoeol();
+    printw("%s", prompt);
+    echo();
+    int rc = getnstr(buffer, size - 1);
+    noecho();
+    return rc != ERR && buffer[0] != '\0';
+}
+
+// Function to split a 's/old/new/flags' field at the next unescaped delimiter
+char* splitField(char* str, char delim) {
+    char* out = str;
+    for (char* p = str; *p; p++) {
+        if (*p == '\\' && p[1] == delim) {
+            *out++ = *++p;
+        } else if (*p == delim) {
+            *out = '\0';
+            return p + 1;
+        } else {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+    return NULL;
+}
+
+// Function to insert 'len' bytes of text into a line at position x
+void insertText(char** lines, int y, int x, const char* text, int len) {
+    int lineLen = strlen(lines[y]);
+    lines[y] = (char*)realloc(lines[y], lineLen + len + 1);
+    memmove(&lines[y][x + len], &lines[y][x], lineLen - x + 1);
+    memcpy(&lines[y][x], text, len);
+}
+
+// Function to delete 'len' bytes of a line starting at position x
+void deleteText(char** lines, int y, int x, int len) {
+    int lineLen = strlen(lines[y]);
+    memmove(&lines[y][x], &lines[y][x + len], lineLen - x - len + 1);
+}
+
+// Function to split a line into two lines at position x
+void splitLine(char*** lines, int* numLines, int y, int x) {
+    *lines = (char**)realloc(*lines, (*numLines + 1) * sizeof(char*));
+    memmove(&(*lines)[y + 2], &(*lines)[y + 1], (*numLines - y - 1) * sizeof(char*));
+    (*lines)[y + 1] = strdup(&(*lines)[y][x]);
+    (*lines)[y][x] = '\0';
+    (*numLines)++;
+}
+
+// Function to merge the line below into line y
+void mergeLine(char** lines, int* numLines, int y) {
+    int len = strlen(lines[y]);
+    int len_next = strlen(lines[y + 1]);
+    lines[y] = (char*)realloc(lines[y], len + len_next + 1);
+    memcpy(&lines[y][len], lines[y + 1], len_next + 1);
+    free(lines[y + 1]);
+
+    // Shift the lines below up by one position
+    memmove(&lines[y + 1], &lines[y + 2], (*numLines - y - 2) * sizeof(char*));
+    (*numLines)--;
+}
+
+// Function to initialize an empty undo journal
+void journalInit(viJournal* journal, size_t budget) {
+    memset(journal, 0, sizeof(*journal));
+    journal->budget = budget;
+    journal->nextGroup = 1;
+}
+
+// Function to free one recorded edit
+void freeEdit(viJournal* journal, viEdit* edit) {
+    journal->bytes -= sizeof(viEdit) + edit->capacity;
+    free(edit->text);
+    free(edit);
+}
+
+// Function to push an edit on one of the journal stacks
+void pushEdit(viEdit*** stack, int* num, int* capacity, viEdit* edit) {
+    if (*num == *capacity) {
+        *capacity = (*capacity) ? 2 * (*capacity) : 64;
+        *stack = (viEdit**)realloc(*stack, (*capacity) * sizeof(viEdit*));
+    }
+    (*stack)[(*num)++] = edit;
+}
+
+// Function to stop coalescing keystrokes into the last edit
+void journalSeal(viJournal* journal) {
+    if (journal->numUndo > 0) {
+        journal->undo[journal->numUndo - 1]->sealed = 1;
+    }
+}
+
+// Function to drop the oldest edits until the journal fits its budget
+void journalTrim(viJournal* journal) {
+    int k = 0;
+    int group = 0;
+    while (journal->bytes > journal->budget && k < journal->numUndo) {
+        group = journal->undo[k]->group;
+        freeEdit(journal, journal->undo[k++]);
+    }
+    // Never keep half of a group, it could only be undone partially
+    while (group != 0 && k < journal->numUndo && journal->undo[k]->group == group) {
+        freeEdit(journal, journal->undo[k++]);
+    }
+    if (group != 0 && group == journal->nextGroup - 1) {
+        journal->droppedGroup = group; // the rest of the group being recorded is dropped too
+    }
+    if (k > 0) {
+        memmove(journal->undo, journal->undo + k, (journal->numUndo - k) * sizeof(viEdit*));
+        journal->numUndo -= k;
+    }
+}
+
+// Function to record an edit, consecutive keystrokes are coalesced into one run
+void journalRecord(viJournal* journal, int type, int group, int y, int x, const char* text, int len, int beforeX, int beforeY, int afterX, int afterY) {
+    if (group != 0 && group == journal->droppedGroup) {
+        return;
+    }
+
+    // Any new edit makes the redo history unreachable
+    while (journal->numRedo > 0) {
+        freeEdit(journal, journal->redo[--journal->numRedo]);
+    }
+
+    viEdit* top = journal->numUndo ? journal->undo[journal->numUndo - 1] : NULL;
+    int coalesce = top && !top->sealed && group == 0 && top->type == type && top->y == y &&
+                   ((type == EDIT_INSERT && x == top->x + top->len) || (type == EDIT_DELETE && x == top->x - 1));
+
+    viEdit* edit = top;
+    if (!coalesce) {
+        edit = (viEdit*)calloc(1, sizeof(viEdit));
+        edit->type = type;
+        edit->group = group;
+        edit->y = y;
+        edit->x = x;
+        edit->beforeX = beforeX;
+        edit->beforeY = beforeY;
+        journal->bytes += sizeof(viEdit);
+        journalSeal(journal);
+        pushEdit(&journal->undo, &journal->numUndo, &journal->undoCapacity, edit);
+    } else if (type == EDIT_DELETE) {
+        edit->x = x; // deleted runs grow to the left
+    }
+
+    int needed = edit->len + len + (type == EDIT_LINE ? 0 : 1);
+    if (needed > edit->capacity) {
+        int capacity = (needed > 2 * edit->capacity) ? needed : 2 * edit->capacity;
+        journal->bytes += capacity - edit->capacity;
+        edit->text = (char*)realloc(edit->text, capacity);
+        edit->capacity = capacity;
+    }
+    memcpy(edit->text + edit->len, text, len);
+    edit->len += len;
+    edit->afterX = afterX;
+    edit->afterY = afterY;
+
+    journalTrim(journal);
+}
+
+// Function to record the substitution of a whole line
+void journalRecordLine(viJournal* journal, int group, int y, const char* oldLine, const char* newLine, int cursorX, int cursorY) {
+    int oldLen = strlen(oldLine);
+    int newLen = strlen(newLine);
+    char* text = (char*)malloc(oldLen + newLen + 2);
+    memcpy(text, oldLine, oldLen + 1);
+    memcpy(text + oldLen + 1, newLine, newLen + 1);
+    journalRecord(journal, EDIT_LINE, group, y, 0, text, oldLen + newLen + 2, cursorX, cursorY, cursorX, cursorY);
+    free(text);
+}
+
+// Function to undo or redo one edit on the buffer
+void applyEdit(viEdit* edit, char*** lines, int* numLines, int undo) {
+    switch (edit->type) {
+        case EDIT_INSERT:
+            if (undo) {
+                deleteText(*lines, edit->y, edit->x, edit->len);
+            } else {
+                insertText(*lines, edit->y, edit->x, edit->text, edit->len);
+            }
+            break;
+        case EDIT_DELETE:
+            if (undo) {
+                // The run was deleted right to left, restore it and reverse it in place
+                insertText(*lines, edit->y, edit->x, edit->text, edit->len);
+                char* run = &(*lines)[edit->y][edit->x];
+                for (int i = 0, j = edit->len - 1; i < j; i++, j--) {
+                    char c = run[i];
+                    run[i] = run[j];
+                    run[j] = c;
+                }
+            } else {
+                deleteText(*lines, edit->y, edit->x, edit->len);
+            }
+            break;
+        case EDIT_SPLIT:
+            if (undo) {
+                mergeLine(*lines, numLines, edit->y);
+            } else {
+                splitLine(lines, numLines, edit->y, edit->x);
+            }
+            break;
+        case EDIT_MERGE:
+            if (undo) {
+                splitLine(lines, numLines, edit->y, edit->x);
+            } else {
+                mergeLine(*lines, numLines, edit->y);
+            }
+            break;
+        case EDIT_LINE:
+            free((*lines)[edit->y]);
+            (*lines)[edit->y] = undo ? strdup(edit->text) : strdup(edit->text + strlen(edit->text) + 1);
+            break;
+    }
+}
+
+// Function to undo (or redo) the last edit or group of edits, returns 0 if there was none
+int journalApply(viJournal* journal, char*** lines, int* numLines, int* cursorX, int* cursorY, int undo) {
+    viEdit*** from = undo ? &journal->undo : &journal->redo;
+    int* numFrom = undo ? &journal->numUndo : &journal->numRedo;
+    if (*numFrom == 0) {
+        return 0;
+    }
+
+    int group = (*from)[*numFrom - 1]->group;
+    do {
+        viEdit* edit = (*from)[--(*numFrom)];
+        applyEdit(edit, lines, numLines, undo);
+        edit->sealed = 1;
+        if (undo) {
+            pushEdit(&journal->redo, &journal->numRedo, &journal->redoCapacity, edit);
+            *cursorX = edit->beforeX;
+            *cursorY = edit->beforeY;
+        } else {
+            pushEdit(&journal->undo, &journal->numUndo, &journal->undoCapacity, edit);
+            *cursorX = edit->afterX;
+            *cursorY = edit->afterY;
+        }
+    } while (group != 0 && *numFrom > 0 && (*from)[*numFrom - 1]->group == group);
+    return 1;
+}
+
+// Function to free the memory used by the journal
+void journalFree(viJournal* journal) {
+    for (int i = 0; i < journal->numUndo; i++) {
+        freeEdit(journal, journal->undo[i]);
+    }
+    for (int i = 0; i < journal->numRedo; i++) {
+        freeEdit(journal, journal->redo[i]);
+    }
+    free(journal->undo);
+    free(journal->redo);
 }
 
-// Function to display text and update the cursor position
-void displayText(char** lines, int numLines, int cursorX, int cursorY) {
+// Function to display the visible part of the text and update the cursor position
+void displayText(char** lines, int numLines, int cursorX, int cursorY, int topLine, viSearch* search, const char* status) {
     clear();
-    // Display each line
-    for (int i = 0; i < numLines; i++) {
-        mvprintw(i, 0, "%s", lines[i]);
+    // Display each line of the viewport, the last screen row is kept for the status
+    for (int row = 0; row < LINES - 1 && topLine + row < numLines; row++) {
+        char* line = lines[topLine + row];
+        mvaddnstr(row, 0, line, COLS);
+
+        // Highlight the matches of the last search
+        if (search && search->patLen > 0) {
+            int len = strlen(line);
+            int pos = searchLine(search, line, len, 0);
+            while (pos >= 0 && pos < COLS) {
+                mvchgat(row, pos, search->patLen, A_REVERSE, 0, NULL);
+                pos = searchLine(search, line, len, pos + search->patLen);
+            }
+        }
+    }
+    if (status) {
+        mvprintw(LINES - 1, 0, "%s", status);
     }
     // Moving cursor to current position
-    move(cursorY, cursorX);
+    move(cursorY - topLine, cursorX);
     refresh();
 }
 
@@ -214,6 +2074,13 @@ viStats myvi(char* filename) {
     int numLinesModified = 0;
     int numWordsModified = 0;
     int numCharsModified = 0;
+    int topLine = 0;            // first line shown in the viewport
+    viSearch search;
+    search.patLen = 0;
+    search.backward = 0;
+    char status[2 * MAX_PATTERN + 64] = "";
+    viJournal journal;
+    journalInit(&journal, UNDO_BUDGET);
 
     // Load file content into 'lines' array
     // Initialize 'numLines', allocate memory for 'lines', and populate 'numChars'
@@ -228,21 +2095,32 @@ viStats myvi(char* filename) {
 
     int go = 1;
     while (go) {
-        displayText(lines, numLines, cursorX, cursorY); // display the text from the file loaded
+        // Scroll the viewport to keep the cursor visible
+        if (cursorY < topLine) {
+            topLine = cursorY;
+        } else if (cursorY >= topLine + LINES - 1) {
+            topLine = cursorY - LINES + 2;
+        }
+        displayText(lines, numLines, cursorX, cursorY, topLine, &search, status); // display the text from the file loaded
+        status[0] = '\0';
 
         int ch = getch();
 
         switch (ch) {
             case KEY_LEFT:
+                journalSeal(&journal);
                 cursorX = (cursorX > 0) ? cursorX - 1 : 0;
                 break;
             case KEY_RIGHT:
+                journalSeal(&journal);
                 cursorX = (cursorX < (int)strlen(lines[cursorY])) ? cursorX + 1 : strlen(lines[cursorY]);
                 break;
             case KEY_UP:
+                journalSeal(&journal);
                 cursorY = (cursorY > 0) ? cursorY - 1 : 0;
                 break;
             case KEY_DOWN:
+                journalSeal(&journal);
                 cursorY = (cursorY < numLines - 1) ? cursorY + 1 : numLines - 1;
                 break;
             case 24: // Ctrl + X
@@ -260,53 +2138,27 @@ viStats myvi(char* filename) {
             case 330: // DELETE key
                 if (cursorX > 0) {
                     // Delete the character at cursorX
-                    memmove(&lines[cursorY][cursorX], &lines[cursorY][cursorX + 1], strlen(lines[cursorY]) - cursorX);
+                    if (cursorX < (int)strlen(lines[cursorY])) {
+                        journalRecord(&journal, EDIT_DELETE, 0, cursorY, cursorX, &lines[cursorY][cursorX], 1, cursorX, cursorY, cursorX - 1, cursorY);
+                        deleteText(lines, cursorY, cursorX, 1);
+                    } else {
+                        journalSeal(&journal);
+                    }
                     cursorX--;
                     numCharsModified++;
                 } else if (cursorY > 0) {
                     // Merge the current line with the previous line
                     int len = strlen(lines[cursorY - 1]);
-                    int len_current = strlen(lines[cursorY]);
-                    lines[cursorY - 1] = (char*)realloc(lines[cursorY - 1], len + len_current + 1);
-                    strcat(lines[cursorY - 1], lines[cursorY]);
-                    free(lines[cursorY]);
-                    
-                    // Shift the lines below up by one position
-                    for (int i = cursorY; i < numLines - 1; i++) {
-                        lines[i] = lines[i + 1];
-                    }
+                    journalRecord(&journal, EDIT_MERGE, 0, cursorY - 1, len, NULL, 0, cursorX, cursorY, cursorX, cursorY - 1);
+                    mergeLine(lines, &numLines, cursorY - 1);
                     cursorY--;
-                    numLines--;
                     numLinesModified++;
                 }
                 break;
             case 10: // ENTER key
-                // Allocate memory for the new line
-                char* newLine = (char*)malloc(1);
-                newLine[0] = '\0';
-
-                if (numLines == 0) {
-                    // If there are no lines, create a new one and assign it to 'lines'
-                    lines = (char**)malloc(sizeof(char*));
-                    lines[0] = newLine;
-                    numLines = 1;
-                } else {
-                    // Insert the new line below the current line
-                    lines = (char**)realloc(lines, (numLines + 1) * sizeof(char*));
-                    for (int i = numLines; i > cursorY + 1; i--) {
-                        lines[i] = lines[i - 1];
-                    }
-                    lines[cursorY + 1] = newLine;
-                    numLines++;
-                }
-
                 // Split the current line into two lines at the cursor position
-                int len_current = strlen(lines[cursorY]);
-                char* temp = (char*)malloc(len_current - cursorX + 1);
-                strcpy(temp, &lines[cursorY][cursorX]);
-                lines[cursorY][cursorX] = '\0';
-                lines[cursorY + 1] = (char*)realloc(lines[cursorY + 1], len_current - cursorX + 1);
-                strcpy(lines[cursorY + 1], temp);
+                journalRecord(&journal, EDIT_SPLIT, 0, cursorY, cursorX, NULL, 0, cursorX, cursorY, 0, cursorY + 1);
+                splitLine(&lines, &numLines, cursorY, cursorX);
 
                 // Update cursor position
                 cursorX = 0;
@@ -314,197 +2166,1041 @@ viStats myvi(char* filename) {
 
                 numLinesModified++;
                 break;
+            case 26: // Ctrl+Z (Undo)
+            case 25: // Ctrl+Y (Redo)
+                if (!journalApply(&journal, &lines, &numLines, &cursorX, &cursorY, ch == 26)) {
+                    snprintf(status, sizeof(status), ch == 26 ? "Already at oldest change" : "Already at newest change");
+                }
+                break;
+
+            case 19: // Ctrl+S (Save)
+                if (filename) {         // Writing 'lines' to the file
+                    saveToFile(filename, lines, numLines);
+                }
+                break;
+            case 6: { // Ctrl+F (/pattern, ?pattern or %s/old/new/[g][i])
+                char input[2 * MAX_PATTERN];
+                if (!promptLine(":", input, sizeof(input))) {
+                    break;
+                }
+
+                if (input[0] == '/' || input[0] == '?') {
+                    // '\c' anywhere in the pattern makes the search case-insensitive
+                    char* pattern = input + 1;
+                    char* flag = strstr(pattern, "\\c");
+                    if (flag) {
+                        memmove(flag, flag + 2, strlen(flag + 2) + 1);
+                    }
+                    compileSearch(&search, pattern, flag != NULL);
+                    search.backward = (input[0] == '?');
+                    if (search.patLen == 0) {
+                        snprintf(status, sizeof(status), "Error: Empty pattern");
+                        break;
+                    }
+
+                    int count = searchBuffer(&search, lines, numLines, count_matches, NULL, 0, NULL);
+                    if (count > 0) {
+                        findNext(&search, lines, numLines, &cursorX, &cursorY, search.backward);
+                    }
+                    snprintf(status, sizeof(status), "%d matches for '%s'", count, search.pattern);
+                } else if (strncmp(input, "%s", 2) == 0 && input[2] != '\0') {
+                    char delim = input[2];
+                    char* pattern = input + 3;
+                    char* replacement = splitField(pattern, delim);
+                    char* flags = replacement ? splitField(replacement, delim) : NULL;
+                    if (!replacement || pattern[0] == '\0') {
+                        snprintf(status, sizeof(status), "Usage: %%s/old/new/[g][i]");
+                        break;
+                    }
+                    int global = flags && strchr(flags, 'g');
+                    compileSearch(&search, pattern, flags && strchr(flags, 'i'));
+
+                    // Keep the replaced lines so the substitution can be undone as one group
+                    char** oldLines = (char**)calloc(numLines, sizeof(char*));
+                    int count = searchBuffer(&search, lines, numLines, replace_matches, replacement, global, oldLines);
+                    int group = journal.nextGroup++;
+                    for (int i = 0; i < numLines; i++) {
+                        if (oldLines[i]) {
+                            journalRecordLine(&journal, group, i, oldLines[i], lines[i], cursorX, cursorY);
+                            free(oldLines[i]);
+                        }
+                    }
+                    free(oldLines);
+                    if (cursorX > (int)strlen(lines[cursorY])) {
+                        cursorX = strlen(lines[cursorY]);
+                    }
+                    numCharsModified += count;
+                    search.patLen = 0; // nothing left to highlight
+                    snprintf(status, sizeof(status), "%d substitutions", count);
+                } else {
+                    snprintf(status, sizeof(status), "Error: Unknown command '%s'", input);
+                }
+                break;
+            }
+            case 14: // Ctrl+N (next match)
+            case 16: // Ctrl+P (previous match)
+                if (search.patLen == 0) {
+                    snprintf(status, sizeof(status), "Error: No previous search");
+                } else if (!findNext(&search, lines, numLines, &cursorX, &cursorY, search.backward != (ch == 16))) {
+                    snprintf(status, sizeof(status), "Pattern not found: %s", search.pattern);
+                }
+                break;
+            default:
+                // Handle character insertion
+                char c = (char)ch;
+                journalRecord(&journal, EDIT_INSERT, 0, cursorY, cursorX, &c, 1, cursorX, cursorY, cursorX + 1, cursorY);
+                insertText(lines, cursorY, cursorX, &c, 1);
+                cursorX++;
+                numCharsModified++;
+                break;
+        }
+    }
+
+    numWordsModified += countWords(lines[cursorY]);
+
+    // Free memory used by 'lines' and the undo journal
+    freeLines(lines, numLines);
+    journalFree(&journal);
+    
+    // Close window
+    endwin();
+
+    viStats stats;
+    stats.lines = numLinesModified;
+    stats.words = numWordsModified;
+    stats.characters = numCharsModified;
+
+    return stats; // return editor stats
+}
+
+// vectorized addition function for threads
+void* add_vector(void* args) {
+    struct ThreadArgs* targs = (struct ThreadArgs*)args;
+    if (targs->policy) {
+        applyPolicy(targs->policy, 0);
+    }
+    for (int i = targs->start_idx; i < targs->end_idx; i++) {
+        targs->result[i] = targs->vec1[i] + targs->vec2[i];
+    }
+    pthread_exit(NULL);
+}
+
+// vectorized subtract function for threads
+void* subtract_vector(void* args) {
+    struct ThreadArgs* targs = (struct ThreadArgs*)args;
+    if (targs->policy) {
+        applyPolicy(targs->policy, 0);
+    }
+    for (int i = targs->start_idx; i < targs->end_idx; i++) {
+        targs->result[i] = targs->vec1[i] - targs->vec2[i];
+    }
+    pthread_exit(NULL);
+}
+
+// vectorized dotproduct function for threads
+void* dot_product(void* args) {
+    struct ThreadArgs* targs = (struct ThreadArgs*)args;
+    if (targs->policy) {
+        applyPolicy(targs->policy, 0);
+    }
+    double dot_prod = 0;
+    for (int i = targs->start_idx; i < targs->end_idx; i++) {
+        dot_prod += targs->vec1[i] * targs->vec2[i];
+    }
+    targs->partial = dot_prod; // summed by executeThread after the join
+    pthread_exit(NULL);
+}
+
+// merge addition or subtraction of two sparse vectors for threads
+void* merge_vector(void* args) {
+    struct ThreadArgs* targs = (struct ThreadArgs*)args;
+    if (targs->policy) {
+        applyPolicy(targs->policy, 0);
+    }
+    const vecData* a = targs->sparse1;
+    const vecData* b = targs->sparse2;
+    int i = targs->start_idx, j = targs->start2;
+    int first = i + j; // a range never writes more values than it reads
+    int n = first;
+    while (i < targs->end_idx || j < targs->end2) {
+        int index;
+        double value;
+        if (j == targs->end2 || (i < targs->end_idx && a->idx[i] < b->idx[j])) {
+            index = a->idx[i];
+            value = a->val[i++];
+        } else if (i == targs->end_idx || b->idx[j] < a->idx[i]) {
+            index = b->idx[j];
+            value = targs->sign * b->val[j++];
+        } else {
+            index = a->idx[i];
+            value = a->val[i++] + targs->sign * b->val[j++];
+        }
+        if (value != 0.0) { // values that cancel out are not stored
+            targs->result_idx[n] = index;
+            targs->result[n] = value;
+            n++;
+        }
+    }
+    targs->result_nnz = n - first;
+    pthread_exit(NULL);
+}
+
+// merge dotproduct of two sparse vectors for threads
+void* merge_dot_product(void* args) {
+    struct ThreadArgs* targs = (struct ThreadArgs*)args;
+    if (targs->policy) {
+        applyPolicy(targs->policy, 0);
+    }
+    const vecData* a = targs->sparse1;
+    const vecData* b = targs->sparse2;
+    int i = targs->start_idx, j = targs->start2;
+    double dot_prod = 0;
+    while (i < targs->end_idx && j < targs->end2) {
+        if (a->idx[i] < b->idx[j]) {
+            i++;
+        } else if (b->idx[j] < a->idx[i]) {
+            j++;
+        } else {
+            dot_prod += a->val[i++] * b->val[j++];
+        }
+    }
+    targs->partial = dot_prod;
+    pthread_exit(NULL);
+}
+
+// scatter a sparse vector into a dense result for threads, the result holds the dense operand
+void* gather_vector(void* args) {
+    struct ThreadArgs* targs = (struct ThreadArgs*)args;
+    if (targs->policy) {
+        applyPolicy(targs->policy, 0);
+    }
+    const vecData* a = targs->sparse1;
+    for (int k = targs->start_idx; k < targs->end_idx; k++) {
+        targs->result[a->idx[k]] += targs->sign * a->val[k];
+    }
+    pthread_exit(NULL);
+}
+
+// gather dotproduct of a sparse and a dense vector for threads
+void* gather_dot_product(void* args) {
+    struct ThreadArgs* targs = (struct ThreadArgs*)args;
+    if (targs->policy) {
+        applyPolicy(targs->policy, 0);
+    }
+    const vecData* a = targs->sparse1;
+    double dot_prod = 0;
+    for (int k = targs->start_idx; k < targs->end_idx; k++) {
+        dot_prod += a->val[k] * targs->vec1[a->idx[k]];
+    }
+    targs->partial = dot_prod;
+    pthread_exit(NULL);
+}
+
+// Function to split the merge of two sparse vectors after d of their nonzeros,
+// an index present in both vectors is kept on one side of the split
+void mergeSplit(const vecData* a, const vecData* b, int d, int* i_split, int* j_split) {
+    int lo = (d > b->nnz) ? d - b->nnz : 0;
+    int hi = (d < a->nnz) ? d : a->nnz;
+    // find how many nonzeros of a come before the split
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (a->idx[mid] <= b->idx[d - mid - 1]) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *i_split = lo;
+    *j_split = d - lo;
+    if (lo > 0 && *j_split < b->nnz && a->idx[lo - 1] == b->idx[*j_split]) {
+        (*j_split)++;
+    }
+}
+
+// Function to free the arrays of a vector
+void freeVector(vecData* vec) {
+    free(vec->idx);
+    free(vec->val);
+}
+
+// read a vector from a file, either plain values or sorted <index>:<value> pairs
+int readVector(char* file_name, vecData* vec) {
+    memset(vec, 0, sizeof(*vec));
+    FILE* file = fopen(file_name, "r");
+    if (!file) {
+        printf("Error: Cannot open input file '%s'.\n", file_name);
+        return -1;
+    }
+
+    int capacity = 0;
+    char token[64];
+    while (fscanf(file, "%63s", token) == 1) {
+        char* colon = strchr(token, ':');
+        if (vec->nnz == 0) {
+            vec->sparse = (colon != NULL); // the first value decides the format
+        } else if (vec->sparse != (colon != NULL)) {
+            printf("Error: '%s' mixes dense and sparse values.\n", file_name);
+            break;
+        }
+        if (vec->nnz == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            vec->val = (double*)realloc(vec->val, capacity * sizeof(double));
+            if (vec->sparse) {
+                vec->idx = (int*)realloc(vec->idx, capacity * sizeof(int));
+            }
+        }
+
+        char* end;
+        if (vec->sparse) {
+            long index = strtol(token, &end, 10);
+            if (end == token || end != colon || index < 0 || index >= INT_MAX) {
+                printf("Error: Invalid index '%s' in '%s'.\n", token, file_name);
+                break;
+            }
+            if (vec->nnz > 0 && index <= vec->idx[vec->nnz - 1]) {
+                printf("Error: Indices of '%s' are not sorted.\n", file_name);
+                break;
+            }
+            vec->idx[vec->nnz] = (int)index;
+            vec->val[vec->nnz] = strtod(colon + 1, &end);
+            end = (end == colon + 1) ? colon : end; // an empty value is invalid
+        } else {
+            vec->val[vec->nnz] = strtod(token, &end);
+        }
+        if (*end != '\0') {
+            printf("Error: Invalid value '%s' in '%s'.\n", token, file_name);
+            break;
+        }
+        vec->nnz++;
+    }
+
+    int failed = !feof(file);
+    fclose(file);
+    if (failed) {
+        freeVector(vec);
+        return -1;
+    }
+    vec->dimension = vec->sparse ? vec->idx[vec->nnz - 1] + 1 : vec->nnz;
+    return vec->dimension;
+}
+
+// read the vectorized inputs from the file, given filname1 and filename2
+int readVectorfromFile(char* file1_name, char* file2_name, vecData* vec1, vecData* vec2){
+    if (readVector(file1_name, vec1) < 0) {
+        return -1;
+    }
+    if (readVector(file2_name, vec2) < 0) {
+        freeVector(vec1);
+        return -1;
+    }
+
+    int dimension = (vec1->dimension > vec2->dimension) ? vec1->dimension : vec2->dimension;
+    if (vec1->dimension == 0 || vec2->dimension == 0) {
+        printf("Error: Empty or invalid input files.\n");
+        dimension = -1;
+    }
+    // a sparse vector only has to fit into a dense one
+    else if ((!vec1->sparse && vec1->dimension != dimension) || (!vec2->sparse && vec2->dimension != dimension)) {
+        printf("\nError: Vector size mismatch\n");
+        dimension = -1;
+    }
+    if (dimension < 0) {
+        freeVector(vec1);
+        freeVector(vec2);
+    }
+    return dimension;
+}
+
+// Thread execution function
+int executeThread(char** parsedArgs, int num_args, const schedPolicy* policy) {
+    if (num_args < 3) {
+        printf("Error: Missing input files\n");
+        return 1;
+    }
+
+    char* operation = parsedArgs[0]; // get operation name
+    char* file1_name = parsedArgs[1]; // get file1 name
+    char* file2_name = parsedArgs[2]; // get file2 name
+
+    int num_threads = MAX_THREADS; // default - 3 Threads 
+    if ((num_args == 4) && (strncmp(parsedArgs[3], "-", 1) == 0)) {
+        num_threads = atoi(parsedArgs[3] + 1);
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    int add = strcmp(operation, "addvec") == 0;
+    int subtract = strcmp(operation, "subvec") == 0;
+    int dot = strcmp(operation, "dotprod") == 0;
+    if (!add && !subtract && !dot) {
+        printf("Error: Unknown operation '%s'\n", operation);
+        return 1;
+    }
+
+    // read files, store the vectors and return the size of the result
+    vecData vec1, vec2;
+    int dimension = readVectorfromFile(file1_name, file2_name, &vec1, &vec2);
+    if (dimension < 0) {
+        return 1;
+    }
+
+    pthread_t threads[num_threads];
+    struct ThreadArgs targs[num_threads];
+    memset(targs, 0, sizeof(targs));
+    void* (*kernel)(void*);
+    double* result = NULL;
+    int* result_idx = NULL;
+
+    if (!vec1.sparse && !vec2.sparse) {
+        // dense vectors are split by dimension
+        kernel = dot ? dot_product : (subtract ? subtract_vector : add_vector);
+        if (!dot) {
+            result = (double*)malloc(dimension * sizeof(double)); //result array
+        }
+        int chunk_size = dimension / num_threads; // amount of portion assigned to each thread
+        for (int i = 0; i < num_threads; i++) {
+            targs[i].vec1 = vec1.val;
+            targs[i].vec2 = vec2.val;
+            targs[i].result = result;
+            targs[i].start_idx = i * chunk_size;
+            targs[i].end_idx = (i == num_threads - 1) ? dimension : (i + 1) * chunk_size;
+        }
+    } else if (vec1.sparse && vec2.sparse) {
+        // sparse vectors are merged, each thread takes an equal share of the nonzeros of both
+        kernel = dot ? merge_dot_product : merge_vector;
+        int total = vec1.nnz + vec2.nnz;
+        if (!dot) {
+            result = (double*)malloc(total * sizeof(double));
+            result_idx = (int*)malloc(total * sizeof(int));
+        }
+        for (int i = 0; i < num_threads; i++) {
+            targs[i].sparse1 = &vec1;
+            targs[i].sparse2 = &vec2;
+            targs[i].result = result;
+            targs[i].result_idx = result_idx;
+            targs[i].sign = subtract ? -1 : 1;
+            mergeSplit(&vec1, &vec2, (long)total * i / num_threads, &targs[i].start_idx, &targs[i].start2);
+            mergeSplit(&vec1, &vec2, (long)total * (i + 1) / num_threads, &targs[i].end_idx, &targs[i].end2);
+        }
+    } else {
+        // the nonzeros of the sparse vector are split, the dense one is only indexed by them
+        const vecData* sparse = vec1.sparse ? &vec1 : &vec2;
+        const vecData* dense = vec1.sparse ? &vec2 : &vec1;
+        kernel = dot ? gather_dot_product : gather_vector;
+        if (!dot) {
+            // the result starts as the dense operand, negated for sparse - dense
+            result = (double*)malloc(dimension * sizeof(double));
+            for (int i = 0; i < dimension; i++) {
+                result[i] = (subtract && vec1.sparse) ? -dense->val[i] : dense->val[i];
+            }
+        }
+        for (int i = 0; i < num_threads; i++) {
+            targs[i].sparse1 = sparse;
+            targs[i].vec1 = dense->val;
+            targs[i].result = result;
+            targs[i].sign = (subtract && vec2.sparse) ? -1 : 1;
+            targs[i].start_idx = (long)sparse->nnz * i / num_threads;
+            targs[i].end_idx = (long)sparse->nnz * (i + 1) / num_threads;
+        }
+    }
+
+    // Threads start on the cpus of the 'with' prefix, nice and I/O priority are set by each thread
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (policy && policy->set_cpus) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &policy->cpus);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        targs[i].policy = policy;
+        pthread_create(&threads[i], &attr, kernel, &targs[i]);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_attr_destroy(&attr);
+
+    // Print the result
+    if (dot) {
+        double dot_prod = 0;
+        for (int i = 0; i < num_threads; i++) {
+            dot_prod += targs[i].partial;
+        }
+        printf("Dot Product: %.2f\n", dot_prod);
+    } else if (result_idx) {
+        // each thread left its nonzeros where its range of the merge starts
+        for (int i = 0; i < num_threads; i++) {
+            int first = targs[i].start_idx + targs[i].start2;
+            for (int k = first; k < first + targs[i].result_nnz; k++) {
+                printf("%d:%.2f ", result_idx[k], result[k]);
+            }
+        }
+        printf("\n");
+    } else {
+        for (int i = 0; i < dimension; i++) {
+            printf("%.2f ", result[i]);
+        }
+        printf("\n");
+    }
+
+    free(result);
+    free(result_idx);
+    freeVector(&vec1);
+    freeVector(&vec2);
+    return 0;
+}
+
+// Function to find the posting list of a trigram, inserting an empty one if asked
+histPosting* histPostingFor(cmdHistory* hist, unsigned int trigram, int insert) {
+    if (insert && 2 * (hist->numTrigrams + 1) > hist->tableSize) {
+        // Grow the table and rehash the existing lists
+        int oldSize = hist->tableSize;
+        histPosting* old = hist->table;
+        hist->tableSize = oldSize ? 2 * oldSize : 4096;
+        hist->table = (histPosting*)calloc(hist->tableSize, sizeof(histPosting));
+        for (int i = 0; i < oldSize; i++) {
+            if (old[i].ids) {
+                unsigned int h = (old[i].trigram * 2654435761u) & (hist->tableSize - 1);
+                while (hist->table[h].ids)
+                    h = (h + 1) & (hist->tableSize - 1);
+                hist->table[h] = old[i];
+            }
+        }
+        free(old);
+    }
+    if (hist->tableSize == 0) {
+        return NULL;
+    }
+
+    unsigned int h = (trigram * 2654435761u) & (hist->tableSize - 1);
+    while (hist->table[h].ids) {
+        if (hist->table[h].trigram == trigram) {
+            return &hist->table[h];
+        }
+        h = (h + 1) & (hist->tableSize - 1);
+    }
+    if (!insert) {
+        return NULL;
+    }
+    hist->table[h].trigram = trigram;
+    hist->table[h].capacity = 4;
+    hist->table[h].ids = (int*)malloc(4 * sizeof(int));
+    hist->numTrigrams++;
+    return &hist->table[h];
+}
+
+// Function to add an entry of the mapped file to the entry list
+void histAddEntry(cmdHistory* hist, size_t offset, int len) {
+    if (hist->numEntries == hist->entryCapacity) {
+        hist->entryCapacity = hist->entryCapacity ? 2 * hist->entryCapacity : 1024;
+        hist->offsets = (size_t*)realloc(hist->offsets, hist->entryCapacity * sizeof(size_t));
+        hist->lengths = (int*)realloc(hist->lengths, hist->entryCapacity * sizeof(int));
+    }
+    hist->offsets[hist->numEntries] = offset;
+    hist->lengths[hist->numEntries] = len;
+    hist->numEntries++;
+}
+
+// Function to add the trigrams of the entries not indexed yet
+void histIndexPending(cmdHistory* hist) {
+    for (int id = hist->numIndexed; id < hist->numEntries; id++) {
+        const unsigned char* text = (const unsigned char*)hist->map + hist->offsets[id];
+        for (int i = 0; i + 2 < hist->lengths[id]; i++) {
+            unsigned int trigram = (text[i] << 16) | (text[i + 1] << 8) | text[i + 2];
+            histPosting* list = histPostingFor(hist, trigram, 1);
+            if (list->count > 0 && list->ids[list->count - 1] == id) {
+                continue; // trigram repeated inside the entry
+            }
+            if (list->count == list->capacity) {
+                list->capacity *= 2;
+                list->ids = (int*)realloc(list->ids, list->capacity * sizeof(int));
+            }
+            list->ids[list->count++] = id;
+        }
+    }
+    hist->numIndexed = hist->numEntries;
+}
+
+// Function to drop the index and the mapping
+void histReset(cmdHistory* hist) {
+    for (int i = 0; i < hist->tableSize; i++) {
+        free(hist->table[i].ids);
+    }
+    free(hist->table);
+    hist->table = NULL;
+    hist->tableSize = 0;
+    hist->numTrigrams = 0;
+    hist->numEntries = 0;
+    hist->numIndexed = 0;
+    if (hist->map) {
+        munmap(hist->map, hist->mapSize);
+    }
+    hist->map = NULL;
+    hist->mapSize = 0;
+    hist->indexed = 0;
+}
+
+// Function to map the entries other shells (or this one) appended since the last call
+void histRefresh(cmdHistory* hist) {
+    struct stat st;
+    if (!hist->path || stat(hist->path, &st) != 0) {
+        return;
+    }
+    // A compaction replaced the file, index it again from the start
+    if (st.st_ino != hist->inode || (size_t)st.st_size < hist->indexed) {
+        histReset(hist);
+        hist->inode = st.st_ino;
+    }
+    if ((size_t)st.st_size == hist->mapSize) {
+        return;
+    }
+
+    int fd = open(hist->path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (hist->map) {
+        munmap(hist->map, hist->mapSize);
+    }
+    hist->mapSize = st.st_size;
+    hist->map = (char*)mmap(NULL, hist->mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hist->map == MAP_FAILED) {
+        hist->map = NULL;
+        histReset(hist);
+        return;
+    }
 
-            case 19: // Ctrl+S (Save)
-                if (filename) {         // Writing 'lines' to the file
-                    saveToFile(filename, lines, numLines);
-                }
-                break;
-            default:
-                // Handle character insertion
-                char c = (char)ch;
-                lines[cursorY] = (char*)realloc(lines[cursorY], strlen(lines[cursorY]) + 2);
-                memmove(&lines[cursorY][cursorX + 1], &lines[cursorY][cursorX], strlen(lines[cursorY]) - cursorX + 1);
-                lines[cursorY][cursorX] = c;
-                cursorX++;
-                numCharsModified++;
-                break;
+    // Split the new complete lines into entries
+    size_t pos = hist->indexed;
+    while (pos < hist->mapSize) {
+        char* end = memchr(hist->map + pos, '\n', hist->mapSize - pos);
+        if (!end) {
+            break;
+        }
+        size_t next = end - hist->map + 1;
+        if (next - pos > 1) {
+            histAddEntry(hist, pos, next - pos - 1);
         }
+        pos = next;
     }
+    hist->indexed = pos;
+}
 
-    numWordsModified += countWords(lines[cursorY]);
+// Function to find the newest entry before 'before' containing the query, returns its id or -1
+int histFind(cmdHistory* hist, const char* query, int before) {
+    int qlen = strlen(query);
+    histIndexPending(hist);
+    if (before > hist->numEntries) {
+        before = hist->numEntries;
+    }
 
-    // Free memory used by 'lines'
-    freeLines(lines, numLines);
-    
-    // Close window
-    endwin();
+    // Pick the shortest posting list among the trigrams of the query
+    histPosting* shortest = NULL;
+    for (int i = 0; i + 2 < qlen; i++) {
+        const unsigned char* q = (const unsigned char*)query + i;
+        histPosting* list = histPostingFor(hist, (q[0] << 16) | (q[1] << 8) | q[2], 0);
+        if (!list) {
+            return -1; // some trigram never occurs
+        }
+        if (!shortest || list->count < shortest->count) {
+            shortest = list;
+        }
+    }
 
-    viStats stats;
-    stats.lines = numLinesModified;
-    stats.words = numWordsModified;
-    stats.characters = numCharsModified;
+    if (!shortest) { // query too short for the index, scan the entries
+        for (int id = before - 1; id >= 0; id--) {
+            if (memmem(hist->map + hist->offsets[id], hist->lengths[id], query, qlen)) {
+                return id;
+            }
+        }
+        return -1;
+    }
 
-    return stats; // return editor stats
+    // Start at the newest candidate before 'before' and verify each one
+    int lo = 0, hi = shortest->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (shortest->ids[mid] < before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (int i = lo - 1; i >= 0; i--) {
+        int id = shortest->ids[i];
+        if (memmem(hist->map + hist->offsets[id], hist->lengths[id], query, qlen)) {
+            return id;
+        }
+    }
+    return -1;
 }
 
-// vectorized addition function for threads
-void* add_vector(void* args) {
-    struct ThreadArgs* targs = (struct ThreadArgs*)args;
-    for (int i = targs->start_idx; i < targs->end_idx; i++) {
-        targs->result[i] = targs->vec1[i] + targs->vec2[i];
+// Function to rewrite the history file with its newest unique entries, called with the file locked
+void histCompact(cmdHistory* hist, int fd, size_t size) {
+    char* map = (char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return;
     }
-    pthread_exit(NULL);
-}
 
-// vectorized subtract function for threads
-void* subtract_vector(void* args) {
-    struct ThreadArgs* targs = (struct ThreadArgs*)args;
-    for (int i = targs->start_idx; i < targs->end_idx; i++) {
-        targs->result[i] = targs->vec1[i] - targs->vec2[i];
+    // Collect the entries newest first, skipping the older copies of a command
+    size_t limit = (size < HISTORY_KEEP_BYTES) ? size : HISTORY_KEEP_BYTES;
+    int tableSize = 1024;
+    while ((size_t)tableSize < limit / 8) {
+        tableSize *= 2;
+    }
+    unsigned int* seen = (unsigned int*)calloc(tableSize, sizeof(unsigned int)); // entry offset + 1
+    unsigned int* keep = (unsigned int*)malloc(tableSize * sizeof(unsigned int));
+    int numKeep = 0;
+    size_t kept = 0;
+
+    size_t end = size;
+    while (end > 0 && kept < HISTORY_KEEP_BYTES && numKeep < tableSize / 2) {
+        size_t start = end - 1;
+        while (start > 0 && map[start - 1] != '\n') {
+            start--;
+        }
+        size_t len = end - 1 - start;
+        if (map[end - 1] == '\n' && len > 0) {
+            unsigned int h = 2166136261u; // FNV-1a
+            for (size_t i = 0; i < len; i++) {
+                h = (h ^ (unsigned char)map[start + i]) * 16777619u;
+            }
+            h &= tableSize - 1;
+            int duplicate = 0;
+            while (seen[h]) {
+                size_t other = seen[h] - 1;
+                if (memchr(map + other, '\n', len + 1) == map + other + len && memcmp(map + other, map + start, len) == 0) {
+                    duplicate = 1;
+                    break;
+                }
+                h = (h + 1) & (tableSize - 1);
+            }
+            if (!duplicate) {
+                seen[h] = start + 1;
+                keep[numKeep++] = start;
+                kept += len + 1;
+            }
+        }
+        end = start;
     }
-    pthread_exit(NULL);
-}
 
-// vectorized dotproduct function for threads
-void* dot_product(void* args) {
-    struct ThreadArgs* targs = (struct ThreadArgs*)args;
-    double dot_prod = 0;
-    for (int i = targs->start_idx; i < targs->end_idx; i++) {
-        dot_prod += targs->vec1[i] * targs->vec2[i];
+    // Write the kept entries oldest first and swap the file in
+    char* tmpPath = (char*)malloc(strlen(hist->path) + 5);
+    sprintf(tmpPath, "%s.tmp", hist->path);
+    // The new file is private until it gets the mode of the old one, a stale one from a crash is replaced
+    struct stat st;
+    unlink(tmpPath);
+    int tmpFd = open(tmpPath, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (tmpFd >= 0 && fstat(fd, &st) == 0) {
+        fchmod(tmpFd, st.st_mode & 0777);
     }
-    targs->result[0] += dot_prod; // store the sum in result[0]
-    pthread_exit(NULL);
+    FILE* tmp = (tmpFd >= 0) ? fdopen(tmpFd, "w") : NULL;
+    if (tmp) {
+        for (int i = numKeep - 1; i >= 0; i--) {
+            char* line = map + keep[i];
+            fwrite(line, 1, (char*)memchr(line, '\n', size - keep[i]) - line + 1, tmp);
+        }
+        if (fclose(tmp) == 0) {
+            rename(tmpPath, hist->path);
+        } else {
+            unlink(tmpPath);
+        }
+    }
+    free(tmpPath);
+    free(seen);
+    free(keep);
+    munmap(map, size);
 }
 
-// read the vectorized inputs from the file, given filname1 and filename2
-int readVectorfromFile(char* file1_name, char* file2_name, double* vec1, double* vec2){
-    int size1 = 0, size2 = 0, dimension = 0;
-    FILE* file1 = fopen(file1_name, "r");
-    FILE* file2 = fopen(file2_name, "r");
-
-    if (file1 && file2) {
-        while (fscanf(file1, "%lf", &vec1[size1]) == 1) // read vector from file1
-            size1++;
+// Function to append a command to the history file shared by all shells
+void histAppend(cmdHistory* hist, const char* command) {
+    if (hist->last && strcmp(hist->last, command) == 0) {
+        return; // ignore consecutive duplicates
+    }
+    free(hist->last);
+    hist->last = strdup(command);
+    add_history(command);
+    if (!hist->path) {
+        return;
+    }
 
-        while (fscanf(file2, "%lf", &vec2[size2]) == 1) // read vector from file2
-            size2++;
+    int len = strlen(command);
+    char* entry = (char*)malloc(len + 2);
+    memcpy(entry, command, len);
+    entry[len] = '\n';
+    entry[len + 1] = '\0';
 
-        fclose(file1);
-        fclose(file2);
+    while (1) {
+        int fd = open(hist->path, O_RDWR | O_APPEND | O_CREAT, 0600);
+        if (fd < 0) {
+            break;
+        }
+        flock(fd, LOCK_EX);
 
-        if(size1 != size2){
-            printf("\nError: Vector size mismatch\n");
-            return -1;
+        // Another shell may have compacted the file while we waited for the lock
+        struct stat fst, pst;
+        if (fstat(fd, &fst) != 0 || stat(hist->path, &pst) != 0 || fst.st_ino != pst.st_ino) {
+            close(fd);
+            continue;
         }
-        dimension = size1;
-    } else {
-        printf("Error: Cannot open input files.\n");
-        return 1;
-    }
-    if (dimension == 0) {
-        printf("Error: Empty or invalid input files.\n");
-        return 1;
+        if (write(fd, entry, len + 1) < 0) {
+            perror("history");
+        } else if ((size_t)fst.st_size + len + 1 > HISTORY_MAX_BYTES) {
+            histCompact(hist, fd, fst.st_size + len + 1);
+        }
+        close(fd); // releases the lock
+        break;
     }
-    return dimension;
+    free(entry);
 }
 
-// Thread execution function
-int executeThread(char* command) {
-    char* parsedArgs[max_args];
+// Function to open the history file and load its newest entries into readline
+void histOpen(cmdHistory* hist) {
+    memset(hist, 0, sizeof(*hist));
+    char* home = getenv("HOME");
+    if (home) {
+        hist->path = (char*)malloc(strlen(home) + strlen(HISTORY_FILE) + 2);
+        sprintf(hist->path, "%s/%s", home, HISTORY_FILE);
+    }
+    histRefresh(hist);
+
+    stifle_history(HISTORY_LOAD); // readline's own list stays bounded in long sessions
+    int first = (hist->numEntries > HISTORY_LOAD) ? hist->numEntries - HISTORY_LOAD : 0;
+    for (int id = first; id < hist->numEntries; id++) {
+        char* entry = strndup(hist->map + hist->offsets[id], hist->lengths[id]);
+        add_history(entry);
+        free(entry);
+    }
+}
 
-    int num_args = processCommand(command, parsedArgs);
+// readline command for Ctrl-R: replace the line with the newest entry containing the typed text,
+// pressing it again steps to older matches
+int histReverseSearch(int count, int key) {
+    (void)count;
+    (void)key;
+    static char* query = NULL;
+    static int before = 0;
+
+    histRefresh(&shellHistory);
+    if (rl_last_func != histReverseSearch) {
+        free(query);
+        query = strdup(rl_line_buffer);
+        before = shellHistory.numEntries;
+    }
 
-    char* operation = parsedArgs[0]; // get operation name
-    char* file1_name = parsedArgs[1]; // get file1 name
-    char* file2_name = parsedArgs[2]; // get file2 name
+    int id = histFind(&shellHistory, query, before);
+    while (id >= 0 && shellHistory.lengths[id] == rl_end && memcmp(shellHistory.map + shellHistory.offsets[id], rl_line_buffer, rl_end) == 0) {
+        id = histFind(&shellHistory, query, id); // same as the line shown, keep going
+    }
+    if (id < 0) {
+        rl_ding();
+        return 0;
+    }
+    before = id;
 
+    char* entry = strndup(shellHistory.map + shellHistory.offsets[id], shellHistory.lengths[id]);
+    rl_replace_line(entry, 0);
+    rl_point = rl_end;
+    free(entry);
+    return 0;
+}
 
-    int num_threads = MAX_THREADS; // default - 3 Threads 
-    if ((num_args == 4) && (strncmp(parsedArgs[3], "-", 1) == 0)) {
-        num_threads = atoi(parsedArgs[3] + 1);
+// history builtin: 'history' lists the newest entries, 'history search <text>' the matching ones
+int historyCommand(char** args, int num_args) {
+    histRefresh(&shellHistory);
+
+    if (num_args > 2 && strcmp(args[1], "search") == 0) {
+        char* query = joinWords(args + 2, num_args - 2);
+        int printed[HISTORY_RESULTS];
+        int numPrinted = 0;
+        int id = histFind(&shellHistory, query, shellHistory.numEntries);
+        while (id >= 0 && numPrinted < HISTORY_RESULTS) {
+            int duplicate = 0;
+            for (int i = 0; i < numPrinted && !duplicate; i++) {
+                duplicate = shellHistory.lengths[printed[i]] == shellHistory.lengths[id] &&
+                            memcmp(shellHistory.map + shellHistory.offsets[printed[i]], shellHistory.map + shellHistory.offsets[id], shellHistory.lengths[id]) == 0;
+            }
+            if (!duplicate) {
+                printf("%6d  %.*s\n", id + 1, shellHistory.lengths[id], shellHistory.map + shellHistory.offsets[id]);
+                printed[numPrinted++] = id;
+            }
+            id = histFind(&shellHistory, query, id);
+        }
+        free(query);
+    } else if (num_args == 1) {
+        int first = (shellHistory.numEntries > HISTORY_SHOW) ? shellHistory.numEntries - HISTORY_SHOW : 0;
+        for (int id = first; id < shellHistory.numEntries; id++) {
+            printf("%6d  %.*s\n", id + 1, shellHistory.lengths[id], shellHistory.map + shellHistory.offsets[id]);
+        }
+    } else {
+        printf("Usage: history [search <text>]\n");
+        return 2;
     }
+    return 0;
+}
 
-    // vector arrays to store the vectors from file
-    double vec1[MAX_VECTOR_DIMENSION];
-    double vec2[MAX_VECTOR_DIMENSION];
-    
-     // read files, store the vector and return the size of vectors
-    int dimension = readVectorfromFile(file1_name, file2_name, vec1, vec2);
+// Function to read the monotonic clock in milliseconds
+long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    double* result = (double*)malloc(dimension * sizeof(double)); //result array
-    pthread_t threads[num_threads];
-    struct ThreadArgs targs[num_threads];
-    int chunk_size = dimension / num_threads; // amount of portion assigned to each thread
+// Function to parse a duration such as 10, 1.5s, 500ms, 2m or 1h into milliseconds, -1 if invalid
+long parseDuration(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) return (long)value;
+    if (strcmp(end, "") == 0 || strcmp(end, "s") == 0) return (long)(value * 1000);
+    if (strcmp(end, "m") == 0) return (long)(value * 60000);
+    if (strcmp(end, "h") == 0) return (long)(value * 3600000);
+    return -1;
+}
 
+// Function to parse a 'timeout [-k GRACE] DURATION' prefix of a stage, returns the index of the first word
+// of the command, 0 if there is no prefix, or -1 on errors
+int parseTimeout(char** words, int num_words, childProc* child) {
+    child->pid = 0;
+    child->status = 0;
+    child->timeout_ms = 0;
+    child->grace_ms = TIMEOUT_GRACE_MS;
+    child->name = NULL;
+    if (num_words == 0 || strcmp(words[0], "timeout") != 0) {
+        return 0;
+    }
 
-    if (strcmp(operation, "addvec") == 0) {
-        for (int i = 0; i < num_threads; i++) {
-            targs[i].vec1 = vec1;
-            targs[i].vec2 = vec2;
-            targs[i].result = result;
-            targs[i].start_idx = i * chunk_size;
-            targs[i].end_idx = (i == num_threads - 1) ? dimension : (i + 1) * chunk_size;
-            pthread_create(&threads[i], NULL, add_vector, &targs[i]);
+    int w = 1;
+    if (w < num_words && strcmp(words[w], "-k") == 0) {
+        child->grace_ms = (w + 1 < num_words) ? parseDuration(words[w + 1]) : -1;
+        w += 2;
+    }
+    child->timeout_ms = (w < num_words) ? parseDuration(words[w]) : -1;
+    w++;
+    if (child->timeout_ms <= 0 || child->grace_ms < 0 || w >= num_words) {
+        printf("Usage: timeout [-k <duration>] <duration> <command>\n");
+        return -1;
+    }
+    return w;
+}
+
+// Function to wait for children with a single poll over their pidfds, sending TERM and then KILL
+// to the process group of a child past its timeout; returns the status of the last child
+int superviseChildren(childProc* children, int num_children) {
+    struct pollfd fds[num_children];
+    int index[num_children];
+    int remaining = 0;
+    long now = monotonicMs();
+
+    for (int i = 0; i < num_children; i++) {
+        children[i].signalled = 0;
+        children[i].deadline = children[i].timeout_ms ? now + children[i].timeout_ms : 0;
+        children[i].pidfd = (children[i].pid > 0) ? syscall(SYS_pidfd_open, children[i].pid, 0) : -1;
+        if (children[i].pid > 0 && children[i].pidfd < 0) { // no pidfd support, fall back to a blocking wait
+            waitpid(children[i].pid, &children[i].status, 0);
+            children[i].pid = 0;
         }
+        remaining += (children[i].pid > 0);
+    }
 
-        for (int i = 0; i < num_threads; i++) {
-            pthread_join(threads[i], NULL);
+    while (remaining > 0) {
+        // Escalate the expired timeouts and find the next deadline
+        int wait_ms = -1;
+        now = monotonicMs();
+        for (int i = 0; i < num_children; i++) {
+            childProc* child = &children[i];
+            if (child->pid <= 0 || child->deadline == 0) {
+                continue;
+            }
+            if (now >= child->deadline) {
+                child->signalled = child->signalled ? SIGKILL : SIGTERM;
+                kill(-child->pid, child->signalled);
+                child->deadline = (child->signalled == SIGTERM) ? now + child->grace_ms : 0;
+                if (child->signalled == SIGTERM) {
+                    kill(-child->pid, SIGCONT); // a stopped group could not act on TERM
+                }
+            }
+            if (child->deadline && (wait_ms < 0 || child->deadline - now < wait_ms)) {
+                wait_ms = child->deadline - now;
+            }
         }
 
-        // Print the result
-        for (int i = 0; i < dimension; i++) {
-            printf("%.2f ", result[i]);
+        int num_fds = 0;
+        for (int i = 0; i < num_children; i++) {
+            if (children[i].pid > 0) {
+                fds[num_fds].fd = children[i].pidfd;
+                fds[num_fds].events = POLLIN;
+                index[num_fds++] = i;
+            }
         }
-        printf("\n");
-    } 
-    else if (strcmp(operation, "subvec") == 0) {
-        for (int i = 0; i < num_threads; i++) {
-            targs[i].vec1 = vec1;
-            targs[i].vec2 = vec2;
-            targs[i].result = result;
-            targs[i].start_idx = i * chunk_size;
-            targs[i].end_idx = (i == num_threads - 1) ? dimension : (i + 1) * chunk_size;
-            pthread_create(&threads[i], NULL, subtract_vector, &targs[i]);
+        if (poll(fds, num_fds, wait_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break; // the children left are reaped below
         }
 
-        for (int i = 0; i < num_threads; i++) {
-            pthread_join(threads[i], NULL);
+        for (int f = 0; f < num_fds; f++) {
+            childProc* child = &children[index[f]];
+            if (fds[f].revents & (POLLIN | POLLHUP)) {
+                waitpid(child->pid, &child->status, 0);
+                close(child->pidfd);
+                child->pid = 0;
+                remaining--;
+            }
         }
+    }
 
-        // Print the result
-        for (int i = 0; i < dimension; i++) {
-            printf("%.2f ", result[i]);
-        }
-        printf("\n");
-    } 
-    else if (strcmp(operation, "dotprod") == 0) {
-        for (int i = 0; i < num_threads; i++) {
-            targs[i].vec1 = vec1;
-            targs[i].vec2 = vec2;
-            targs[i].result = result;
-            targs[i].start_idx = i * chunk_size;
-            targs[i].end_idx = (i == num_threads - 1) ? dimension : (i + 1) * chunk_size;
-            pthread_create(&threads[i], NULL, dot_product, &targs[i]);
+    for (int i = 0; i < num_children; i++) {
+        if (children[i].pid > 0) {
+            waitpid(children[i].pid, &children[i].status, 0);
+            close(children[i].pidfd);
+            children[i].pid = 0;
         }
+    }
 
-        for (int i = 0; i < num_threads; i++) {
-            pthread_join(threads[i], NULL);
+    // Report the timeouts and turn the wait statuses into shell exit statuses
+    int status = 0;
+    for (int i = 0; i < num_children; i++) {
+        childProc* child = &children[i];
+        if (child->signalled && WIFSIGNALED(child->status) && WTERMSIG(child->status) == child->signalled) {
+            fprintf(stderr, "timeout: '%s' timed out after %.3gs%s\n", child->name, child->timeout_ms / 1000.0, child->signalled == SIGKILL ? ", killed" : "");
+            status = TIMEOUT_STATUS;
+        } else if (WIFSIGNALED(child->status)) {
+            fprintf(stderr, "'%s' terminated by signal %d\n", child->name, WTERMSIG(child->status));
+            status = 128 + WTERMSIG(child->status);
+        } else {
+            status = WEXITSTATUS(child->status);
         }
-
-        printf("Dot Product: %.2f\n", result[0]);
-    } else {
-        printf("Error: Unknown operation '%s'\n", operation);
-        return 1;
     }
+    return status;
+}
 
-    return 0;
+// Function to give the terminal to a process group, SIGTTOU is blocked since the shell may not own it
+void setForeground(pid_t pgid) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// Function to tell whether a word names a vector operation
+int isVectorCommand(const char* word) {
+    return strcmp(word, "addvec") == 0 || strcmp(word, "subvec") == 0 || strcmp(word, "dotprod") == 0;
 }
 
 // function to execute single command and multiple pipe separated command
-void execArgsPiped(char* commandList){
+void execArgsPiped(char* commandList, growBuf* hereDocs){
     char* parsedComm[max_commands];
-    int i;
+    int nextDoc = 0;
     int num_comm = processPipe(commandList, parsedComm); //number of pipe separated commands
 
     if(num_comm == 0)
@@ -517,32 +3213,96 @@ void execArgsPiped(char* commandList){
             background = 1;  
         }
         if(!background){
-            if(strncmp(parsedComm[0], "cd", 2) == 0){
-                changeDir(parsedComm[0]);
+            // Builtins that do not read stdin still consume their here-documents
+            int hereFd = hereInput(parsedComm[0], hereDocs, &nextDoc);
+            char** words;
+            int num_words = tokenizeCommand(parsedComm[0], &words);
+            schedPolicy policy;
+            int first = parseWith(words, num_words, &policy);
+            if(num_words == 0){
+                // nothing but redirections
             }
-            else if (strcmp(parsedComm[0], "exit") == 0) {
+            else if(strcmp(words[0], "cd") == 0){
+                lastStatus = changeDir(words, num_words);
+            }
+            else if (strcmp(words[0], "exit") == 0) {
                 printf("\nClosing shell ...\n");
                 exit(0);
             }
-            else if(strncmp(parsedComm[0], "help", 4) == 0){
+            else if(strcmp(words[0], "help") == 0){
                 printHelp();
+                lastStatus = 0;
+            }
+            else if(strcmp(words[0], "history") == 0){
+                lastStatus = historyCommand(words, num_words);
+            }
+            else if(strcmp(words[0], "parallel") == 0){
+                FILE* argInput = (hereFd >= 0) ? fdopen(hereFd, "r") : NULL; // arguments from a here-document
+                lastStatus = parallelCommand(words, num_words, argInput) ? 1 : 0;
+                if (argInput) {
+                    fclose(argInput);
+                    hereFd = -1;
+                }
+            }
+            else if(strcmp(words[0], "vi") == 0){
+                viStats stats = myvi(num_words > 1 ? words[1] : NULL);
+                printf("Lines modified = %d, Words modified = %d, Characters modified = %d", stats.lines, stats.words, stats.characters);
+                lastStatus = 0;
+            }
+            else if(first < 0){
+                lastStatus = 1; // invalid 'with' prefix, already reported
+            }
+            else if(first < num_words && isVectorCommand(words[first])){
+                // The vector thread pool runs in the shell, a 'with' policy is applied to each thread
+                lastStatus = executeThread(words + first, num_words - first, first ? &policy : NULL);
+            }
+            else if(hereFd < 0 && (lastStatus = fastBuiltin(words, num_words)) >= 0){
+                // pwd, mkdir and ls ran in the shell process
             }
             else{
-                pid_t pid = fork();
-
-                if (pid < 0) { 
-                    perror("Failed forking child"); 
-                    exit(1);
-                } else if(pid == 0){
-                    // Child process
-                    execute(parsedComm[0]);
-                    exit(0);
-                }else{
-                    // Parent process
-                    wait(NULL);
-                    return;
+                childProc child;
+                int start = parseTimeout(words, num_words, &child);
+                if (start < 0) {
+                    lastStatus = 2;
+                } else {
+                    child.name = joinWords(words + start, num_words - start);
+                    int foreground = child.timeout_ms && hereFd < 0 && isatty(STDIN_FILENO);
+                    pid_t pid = fork();
+
+                    if (pid < 0) { 
+                        perror("Failed forking child"); 
+                        exit(1);
+                    } else if(pid == 0){
+                        // Child process
+                        if (child.timeout_ms) {
+                            setpgid(0, 0); // own group, so the timeout reaches its descendants
+                        }
+                        if (hereFd >= 0) {
+                            dup2(hereFd, STDIN_FILENO); // read the here-document
+                        }
+                        execute(words + start, num_words - start, hereFd >= 0);
+                        exit(0);
+                    }else{
+                        // Parent process
+                        if (child.timeout_ms) {
+                            setpgid(pid, pid);
+                        }
+                        if (foreground) {
+                            setForeground(pid);
+                        }
+                        child.pid = pid;
+                        lastStatus = superviseChildren(&child, 1);
+                        if (foreground) {
+                            setForeground(getpgrp());
+                        }
+                    }
+                    free(child.name);
                 }
             }
+            if (hereFd >= 0) {
+                close(hereFd);
+            }
+            freeWords(words);
         }
     }
     //multiple pipe separated commands execution
@@ -550,19 +3310,34 @@ void execArgsPiped(char* commandList){
         int i;
         int pipefd[2]; //Pipe file descriptor
         int prev_stdin = 0;
+        childProc children[max_commands];
+        int num_children = 0;
+        pid_t foreground = 0; // group of a timed stage that reads the terminal
 
         for(i=0; i<num_comm; i++){
-            if(strncmp(parsedComm[i], "cd", 2) == 0){
-                changeDir(parsedComm[i]);
+            // Consumed for every stage, so the later stages get their own here-documents
+            int hereFd = hereInput(parsedComm[i], hereDocs, &nextDoc);
+            char** words;
+            int num_words = tokenizeCommand(parsedComm[i], &words);
+            childProc* child = &children[num_children];
+            int start = 0;
+            if(num_words == 0){
+                // nothing but redirections
+            }
+            else if(strcmp(words[0], "cd") == 0){
+                changeDir(words, num_words);
             }
-            else if (strcmp(parsedComm[i], "exit") == 0) {
+            else if (strcmp(words[0], "exit") == 0) {
                 printf("\nClosing shell ...\n");
                 exit(0);
             }
-            else if(strncmp(parsedComm[i], "help", 4) == 0){
+            else if(strcmp(words[0], "help") == 0){
                 printHelp();
             }
-            else{
+            else if((start = parseTimeout(words, num_words, child)) >= 0){
+                // Only the first forked stage reads the shell's input, the later ones read a pipe
+                int ownsTerminal = child->timeout_ms && prev_stdin == 0 && hereFd < 0 && isatty(STDIN_FILENO);
+                child->name = joinWords(words + start, num_words - start);
                 if(pipe(pipefd) < 0){
                     perror("Pipe could not be initialized");
                     exit(1);
@@ -574,6 +3349,12 @@ void execArgsPiped(char* commandList){
                 } else if (pid == 0) {
                     // Child process
                     close(pipefd[0]); // Close the read end of the pipe
+                    if (child->timeout_ms) {
+                        setpgid(0, 0);
+                    }
+                    if (ownsTerminal) {
+                        setForeground(getpid()); // also done here, so it cannot read before the parent hands over
+                    }
 
                     if (i < num_comm - 1) { // if not last command
                         dup2(pipefd[1], STDOUT_FILENO); // set output to the write end of the pipe
@@ -582,24 +3363,277 @@ void execArgsPiped(char* commandList){
                     if (i > 0) { // if not the first command
                         dup2(prev_stdin, STDIN_FILENO); // set input to the prev comm input
                     }
-                    execute(parsedComm[i]);
+                    if (hereFd >= 0) { // a here-document replaces the piped input
+                        dup2(hereFd, STDIN_FILENO);
+                    }
+                    execute(words + start, num_words - start, i > 0 || hereFd >= 0);
                     exit(0);
                 } else {
-                    // Parent process
-                    wait(NULL); // Wait for the child process to finish
+                    // Parent process, all stages run at once and are waited for together below
+                    if (child->timeout_ms) {
+                        setpgid(pid, pid);
+                    }
+                    if (ownsTerminal) {
+                        setForeground(pid);
+                        foreground = pid;
+                    }
+                    child->pid = pid;
+                    num_children++;
                     close(pipefd[1]); // Write end of the pipe closed
+                    if (prev_stdin > 0) {
+                        close(prev_stdin);
+                    }
                     prev_stdin = pipefd[0]; // Prev std input updated
                 }
             } //commands other than cd end
+            if (hereFd >= 0) {
+                close(hereFd);
+            }
+            freeWords(words);
         } //loop end
+        if (prev_stdin > 0) {
+            close(prev_stdin);
+        }
+        lastStatus = superviseChildren(children, num_children);
+        if (foreground) {
+            setForeground(getpgrp());
+        }
+        for (i = 0; i < num_children; i++) {
+            free(children[i].name);
+        }
     } //multi-command end
 }
 
+// Function to find the value of a shell variable, falling back to the environment
+const char* getVariable(const char* name, int len) {
+    for (int i = 0; i < numVars; i++) {
+        if ((int)strlen(shellVars[i].name) == len && strncmp(shellVars[i].name, name, len) == 0) {
+            return shellVars[i].value;
+        }
+    }
+    char env_name[len + 1];
+    memcpy(env_name, name, len);
+    env_name[len] = '\0';
+    return getenv(env_name);
+}
+
+// Function to set a shell variable
+void setVariable(const char* name, int len, const char* value) {
+    for (int i = 0; i < numVars; i++) {
+        if ((int)strlen(shellVars[i].name) == len && strncmp(shellVars[i].name, name, len) == 0) {
+            free(shellVars[i].value);
+            shellVars[i].value = strdup(value);
+            return;
+        }
+    }
+    if (numVars == varCapacity) {
+        varCapacity = varCapacity ? 2 * varCapacity : 16;
+        shellVars = (shellVar*)realloc(shellVars, varCapacity * sizeof(shellVar));
+    }
+    shellVars[numVars].name = strndup(name, len);
+    shellVars[numVars].value = strdup(value);
+    numVars++;
+}
+
+// Function to return the length of the NAME in a 'NAME=value' command, 0 if it is not an assignment
+int assignmentLength(const char* command) {
+    int i = 0;
+    if (!isalpha((unsigned char)command[0]) && command[0] != '_') {
+        return 0;
+    }
+    while (isalnum((unsigned char)command[i]) || command[i] == '_') {
+        i++;
+    }
+    return (command[i] == '=') ? i : 0;
+}
+
+// Function to run a command substitution and append its output without the trailing newlines
+void captureCommand(char* command, growBuf* out) {
+    size_t start = out->len;
+    while (*command == ' ') {
+        command++;
+    }
+    fflush(stdout);
+
+    // Builtins are recognised by their whole first word, 'lsof' is not 'ls'
+    char name[16] = "";
+    size_t name_len = strcspn(command, " |");
+    if (name_len < sizeof(name)) {
+        memcpy(name, command, name_len);
+        name[name_len] = '\0';
+    }
+
+    if (isVectorCommand(name) || strcmp(name, "help") == 0 || strcmp(name, "history") == 0 || strcmp(name, "parallel") == 0 ||
+        strcmp(name, "pwd") == 0 || strcmp(name, "ls") == 0) {
+        // Builtins run in the shell process, with stdout pointed at a memfd
+        int fd = memfd_create("substitution", MFD_CLOEXEC);
+        int saved_stdout = dup(STDOUT_FILENO);
+        if (fd < 0 || saved_stdout < 0) {
+            perror("Could not capture output");
+            return;
+        }
+        dup2(fd, STDOUT_FILENO);
+        execArgsPiped(command, NULL);
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        lseek(fd, 0, SEEK_SET);
+        bufReadFd(out, fd);
+        close(fd);
+    } else {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            perror("Pipe could not be initialized");
+            return;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Failed forking child");
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return;
+        } else if (pid == 0) {
+            // Child process
+            dup2(pipefd[1], STDOUT_FILENO);
+            if (!findSyntax(command, "|")) {
+                char** words;
+                int num_words = tokenizeCommand(command, &words);
+                execute(words, num_words, 0); // a single command replaces the child
+            }
+            execArgsPiped(command, NULL);
+            fflush(stdout);
+            exit(0);
+        }
+        // Parent process
+        close(pipefd[1]);
+        bufReadFd(out, pipefd[0]);
+        close(pipefd[0]);
+        waitpid(pid, NULL, 0);
+    }
+
+    while (out->len > start && out->data[out->len - 1] == '\n') {
+        out->len--;
+    }
+    out->data[out->len] = '\0';
+}
+
+// Function to expand the $NAME, ${NAME}, $? or $(command) at *p into out and move *p past it,
+// returns 0 if *p starts none of them
+int expandDollar(const char** p, growBuf* out) {
+    const char* s = *p;
+    if (s[1] == '(') {
+        const char* close = substitutionEnd(s + 2);
+        char* inner = strndup(s + 2, close - s - 2);
+        captureCommand(inner, out);
+        free(inner);
+        *p = *close ? close + 1 : close;
+    } else if (s[1] == '{' && strchr(s + 2, '}')) {
+        const char* close = strchr(s + 2, '}');
+        const char* value = getVariable(s + 2, close - s - 2);
+        bufAppend(out, value ? value : "", value ? strlen(value) : 0);
+        *p = close + 1;
+    } else if (isalpha((unsigned char)s[1]) || s[1] == '_') {
+        const char* name = ++s;
+        while (isalnum((unsigned char)*s) || *s == '_') {
+            s++;
+        }
+        const char* value = getVariable(name, s - name);
+        bufAppend(out, value ? value : "", value ? strlen(value) : 0);
+        *p = s;
+    } else if (s[1] == '?') {
+        char status[16];
+        bufAppend(out, status, snprintf(status, sizeof(status), "%d", lastStatus));
+        *p = s + 2;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Function to expand $NAME, ${NAME}, $? and $(command) in the value of an assignment
+char* expandWords(const char* text) {
+    growBuf out = {NULL, 0, 0};
+    bufAppend(&out, "", 0);
+    const char* p = text;
+
+    while (*p) {
+        size_t run = strcspn(p, "$\\");
+        bufAppend(&out, p, run);
+        p += run;
+        if (*p == '\0') {
+            break;
+        }
+
+        if (*p == '\\' && p[1] == '$') { // escaped dollar
+            bufAppend(&out, "$", 1);
+            p += 2;
+        } else if (*p != '$' || !expandDollar(&p, &out)) {
+            bufAppend(&out, p, 1);
+            p++;
+        }
+    }
+    return out.data;
+}
+
+// Function to split a command into words in a single pass, $NAME, ${NAME}, $? and $(command) are expanded
+// within their word and their text stays literal: it is not split, globbed or parsed as syntax. A word with
+// glob characters of its own is replaced by the matching paths, one word each, or kept as is if nothing
+// matches; the list is NULL terminated
+int tokenizeCommand(const char* command, char*** words) {
+    char** list = NULL;
+    int num = 0, capacity = 0;
+    growBuf word = {NULL, 0, 0};
+    growBuf pattern = {NULL, 0, 0}; // the word for the glob, with backslashes before literal characters
+    const char* p = command;
+    while (1) {
+        while (*p == ' ') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+
+        word.len = pattern.len = 0;
+        bufAppend(&word, "", 0);
+        bufAppend(&pattern, "", 0);
+        int glob = 0;
+        while (*p && *p != ' ') {
+            size_t expanded = word.len;
+            if (*p == '\\' && p[1] == '$') { // escaped dollar
+                bufAppend(&word, "$", 1);
+                p += 2;
+            } else if (*p != '$' || !expandDollar(&p, &word)) {
+                glob |= (*p == '*' || *p == '?' || *p == '[');
+                bufAppend(&word, p, 1);
+                bufAppend(&pattern, (*p == '\\') ? "\\\\" : p, (*p == '\\') ? 2 : 1);
+                p++;
+                continue;
+            }
+            for (size_t i = expanded; i < word.len; i++) {
+                if (word.data[i] && strchr("*?[\\", word.data[i])) {
+                    bufAppend(&pattern, "\\", 1);
+                }
+                bufAppend(&pattern, word.data + i, 1);
+            }
+        }
+        if (!glob || expandGlob(pattern.data, &list, &num, &capacity) == 0) {
+            appendString(&list, &num, &capacity, strdup(word.data));
+        }
+    }
+    free(word.data);
+    free(pattern.data);
+    appendString(&list, &num, &capacity, NULL);
+    *words = list;
+    return num - 1;
+}
 
 int main(){
     char *line = NULL;
     char *command = NULL;
-    size_t command_size = 0;
+    growBuf hereDocs[max_commands];
+
+    histOpen(&shellHistory);
+    rl_bind_key(18, histReverseSearch); // Ctrl-R
     
     while (1) {
         line = readline("\nshell> ");
@@ -608,62 +3642,46 @@ int main(){
             break;
         }
         
+        growBuf input = {NULL, 0, 0};
+        bufAppend(&input, "", 0);
+        size_t len = strlen(line);
+
         //multi-line command
-        if(strlen(line) > 0 && line[strlen(line) - 1] == '\\'){
-            line[strlen(line) - 1] = ' ';
-            command_size = strlen(line);
-            command = (char*)malloc(command_size + 1);
-            strcpy(command, line);
-            add_history(line);
-
-            while(1){
-                line = readline("> ");
-                //intermediate lines of multiline command
-                if(line[strlen(line) - 1] == '\\'){
-                    line[strlen(line) - 1] = ' ';
-                    command_size += strlen(line);
-                    command = (char *)realloc(command, command_size + 1);
-                    strcat(command, line);
-                    add_history(line);
-                }
-                //ending line of multi-line command
-                else{
-                    command_size += strlen(line);
-                    command = (char *)realloc(command, command_size + 1);
-                    strcat(command, line);
-                    add_history(line);
-                    add_history(command);
-                    free(line);
-                    break;
-                }
-            }
-        }
-        //single-line command
-        else{
-            command_size = strlen(line);
-            command = (char*)malloc(command_size + 1);
-            strcpy(command, line);
-            add_history(line);
+        while(len > 0 && line[len - 1] == '\\'){
+            line[len - 1] = ' ';
+            bufAppend(&input, line, len);
             free(line);
+
+            line = readline("> ");
+            if (line == NULL) {
+                line = strdup("");
+            }
+            len = strlen(line);
         }
+        //single-line command or ending line of multi-line command
+        bufAppend(&input, line, len);
+        free(line);
+        command = input.data;
+        int num_docs = readHereDocs(command, hereDocs);
         
         if (strlen(command) > 0) {
-            if (strncmp(command, "vi ", 3) == 0) {
-                char* filename = command + 3; // Extract filename from the 'vi' command
-                // char path[50] = "./myvi ";                
-                // strcat(path, filename);
-                // printf("%s", path);
-                // system(path);
-                viStats stats = myvi(filename);
-                printf("Lines modified = %d, Words modified = %d, Characters modified = %d", stats.lines, stats.words, stats.characters);
-            }
-            else if (strncmp(command, "addvec", 6) == 0 || strncmp(command, "subvec", 6) == 0 || strncmp(command, "dotprod", 7) == 0){
-                executeThread(command);
+            histAppend(&shellHistory, command); // only the joined command goes to the history
+
+            int name_len = assignmentLength(command);
+            if (name_len > 0) { // NAME=value, the value is not split into words
+                char* value = expandWords(command + name_len + 1);
+                setVariable(command, name_len, value);
+                free(value);
             }
-            else{
-            execArgsPiped(command);
+            else{ // expanded word by word as each stage is tokenized
+                execArgsPiped(command, hereDocs);
             }
         }
+
+        for (int i = 0; i < num_docs; i++) {
+            free(hereDocs[i].data);
+        }
+        free(command);
     }
 
     return 0;